@@ -4,6 +4,11 @@
 layout (location = 0) in vec3 vertexPosition;
 layout (location = 1) in vec3 vertexColor;
 
+// per-instance data : only fed by instanced draws (bricks)
+// otherwise these hold the defaults (0,0,1,1) and (1,1,1) set by the program
+layout (location = 2) in vec4 instanceRect;   // x, y, width, height
+layout (location = 3) in vec3 instanceColor;
+
 uniform mat4 MVP;
 
 // output data : used by fragment shader
@@ -11,11 +16,13 @@ out vec3 fragColor;
 
 void main ()
 {
-    vec4 v = vec4(vertexPosition, 1); // Transform an homogeneous 4D vector
+    // Scale and place the vertex for this instance
+    vec2 position = vertexPosition.xy * instanceRect.zw + instanceRect.xy;
+    vec4 v = vec4(position, vertexPosition.z, 1); // Transform an homogeneous 4D vector
 
     // The color of each vertex will be interpolated
     // to produce the color of each fragment
-    fragColor = vertexColor;
+    fragColor = vertexColor * instanceColor;
 
     // Output position of the vertex, in clip space : MVP * position
     gl_Position = MVP * v;
@@ -3,10 +3,21 @@
 #include <fstream>
 #include <vector>
 #include <map>
+#include <cstring>
+#include <cstdio>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <ao/ao.h>
 
 #define GLM_FORCE_RADIANS
@@ -16,14 +27,23 @@
 
 using namespace std;
 
-struct VAO { // vertex array object
-    GLuint VertexArrayID;
-    GLuint VertexBuffer;
-    GLuint ColorBuffer;
+/* Compact vertex layout: 2D position in fixed point plus an RGBA8 colour,
+   8 bytes a vertex instead of 24. z is always 0 in this game. */
+#define POSITION_SCALE 16.0f    // 1/16 unit steps, covers +-2047 units
 
+struct CompactVertex {
+    GLshort x, y;
+    GLubyte r, g, b, a;
+};
+
+struct VAO { // vertex array object
     GLenum PrimitiveMode;
     GLenum FillMode;
     int NumVertices;
+    int NumIndices;             // 0 unless the VAO is an indexed quad mesh
+
+    CompactVertex* Vertices;    // CPU copy of the vertices, read by the sprite batch
+    float MinX, MinY, MaxX, MaxY;   // bounding box of the vertices, for culling
 };
 typedef struct VAO VAO;
 
@@ -74,6 +94,7 @@ typedef struct Sprite {
     int inAir;            // boolean 0 or 1
     int fixed;            // boolean 0 or 1
     int isMoving;         // boolean 0 or 1
+    int scene_id;         // draw ID in the static scene, see static_scene_add()
 } Sprite;
 
 map <string, Sprite> objects;
@@ -82,7 +103,6 @@ map <int, Sprite> brick;
 map <int, Sprite> mirror;
 map <string, Sprite> bucket;
 map <int, Sprite> lazer;
-map <int, Sprite> sboard;
 int lazmir[1000][2]={0};
 
 struct GLMatrices {
@@ -94,81 +114,316 @@ struct GLMatrices {
 
 GLuint programID;
 
-/* Function to load Shaders - Use it as it is */
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+/*****************
+ * Program cache *
+ *****************/
+/* Linked programs are kept on disk with glGetProgramBinary, one file per
+   program in program_cache.Dir, named after a hash of both sources
+   and the GL vendor, renderer and version strings. An edited shader or
+   another driver gives another name. A file the driver refuses is removed
+   and the program compiled in full, then stored again. Needs GL 4.1 or
+   ARB_get_program_binary, --no-program-cache turns it off. */
+struct ProgramCache {
+    int Enabled;
+    string Dir;
+    int Hits, Misses;
+} program_cache = {1, ".program_cache"};
+
+const char program_cache_magic[4] = {'B','B','P','C'};
+
+double game_time ();
+
+int program_cache_usable ()
+{
+    if (!program_cache.Enabled || !(GLAD_GL_VERSION_4_1 || GLAD_GL_ARB_get_program_binary))
+        return 0;
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    return formats > 0;
+}
+
+/* 64 bit FNV-1a */
+unsigned long long program_cache_hash (unsigned long long hash, const char* data, size_t size)
+{
+    for (size_t i=0; i<size; i++)
+        hash = (hash ^ (unsigned char) data[i]) * 1099511628211ULL;
+    return hash;
+}
+
+string program_cache_path (const string& vertex_code, const string& fragment_code)
+{
+    const char* parts[5] = {vertex_code.c_str(), fragment_code.c_str(), (const char*) glGetString(GL_VENDOR),
+                            (const char*) glGetString(GL_RENDERER), (const char*) glGetString(GL_VERSION)};
+    unsigned long long hash = 14695981039346656037ULL;
+    for (int p=0; p<5; p++)
+        hash = program_cache_hash(hash, parts[p], strlen(parts[p]) + 1);  // the 0 keeps them apart
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bin", hash);
+    return program_cache.Dir + name;
+}
+
+/* The cached program, or 0 when there is none the driver accepts */
+GLuint program_cache_load (const string& path)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file)
+        return 0;
+    char magic[4];
+    GLenum format;
+    vector<char> binary;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file) - (long)(sizeof(magic) + sizeof(format));
+    fseek(file, 0, SEEK_SET);
+    if (size > 0) {
+        binary.resize(size);
+        if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, program_cache_magic, sizeof(magic)) != 0 ||
+            fread(&format, sizeof(format), 1, file) != 1 || fread(&binary[0], size, 1, file) != 1)
+            binary.clear();
+    }
+    fclose(file);
+
+    GLint linked = GL_FALSE;
+    GLuint program = 0;
+    if (!binary.empty()) {
+        program = glCreateProgram();
+        glProgramBinary(program, format, &binary[0], binary.size());
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    }
+    if (!linked) {
+        fprintf(stderr, "Warning: dropping stale program cache file %s\n", path.c_str());
+        if (program)
+            glDeleteProgram(program);
+        remove(path.c_str());
+        return 0;
+    }
+    return program;
+}
+
+void program_cache_store (const string& path, GLuint program)
+{
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+    vector<char> binary(length);
+    GLenum format;
+    glGetProgramBinary(program, length, &length, &format, &binary[0]);
+
+    // Written aside and renamed, so instances starting together never read half a file
+    mkdir(program_cache.Dir.c_str(), 0755);
+    char temp[32];
+    snprintf(temp, sizeof(temp), ".%d", (int) getpid());
+    string temp_path = path + temp;
+    FILE* file = fopen(temp_path.c_str(), "wb");
+    if (!file) {
+        fprintf(stderr, "Warning: could not write %s, programs will not be cached\n", temp_path.c_str());
+        program_cache.Enabled = 0;
+        return;
+    }
+    int ok = fwrite(program_cache_magic, sizeof(program_cache_magic), 1, file) == 1 &&
+             fwrite(&format, sizeof(format), 1, file) == 1 && fwrite(&binary[0], length, 1, file) == 1;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp_path.c_str(), path.c_str()) != 0)
+        remove(temp_path.c_str());
+}
+
+/*******************
+ * Shader programs *
+ *******************/
+/* Building a program is split in two so that every program of the game can
+   compile at once. program_start() reads the sources and submits the
+   compile and link without looking at the results, and the driver works on
+   them in its own threads (ARB/KHR_parallel_shader_compile) while the game
+   sets up. program_finish() checks the results, and only runs on the first
+   use of the program, so a frame waits for the programs it draws with and
+   no others. LoadShaders() does both in one go. */
+struct ShaderProgram {
+    GLuint ID;
+    int Ready;                  // finished, ID can be used
+    int Failed;                 // it did not link
+    const char* VertexPath;
+    const char* FragmentPath;
+    GLuint VertexShaderID, FragmentShaderID;    // 0 for a cached program
+    string CachePath;           // to store it in once linked, empty when not cached
+    double StartTime;
+    int Number;                 // in order of submission, for render sort keys
+    void (*Linked)(GLuint);     // sets uniforms up once linked
+};
+
+struct ShaderCompiler {
+    int Parallel;               // the driver compiles in background threads
+    int Started;
+    double SubmitTime;          // spent in program_start()
+} shader_compiler;
 
-	// Create the shaders
-	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+/* Let the driver compile on as many threads as it likes */
+void shader_compiler_init ()
+{
+    shader_compiler.Parallel = GLAD_GL_ARB_parallel_shader_compile;
+    if (shader_compiler.Parallel)
+        glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+}
 
-	// Read the Vertex Shader code from the file
-	std::string VertexShaderCode;
-	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-	if(VertexShaderStream.is_open())
+std::string read_shader (const char* path)
+{
+	std::string Code;
+	std::ifstream Stream(path, std::ios::in);
+	if(Stream.is_open())
 	{
 		std::string Line = "";
-		while(getline(VertexShaderStream, Line))
-			VertexShaderCode += "\n" + Line;
-		VertexShaderStream.close();
+		while(getline(Stream, Line))
+			Code += "\n" + Line;
+		Stream.close();
 	}
+	return Code;
+}
 
-	// Read the Fragment Shader code from the file
-	std::string FragmentShaderCode;
-	std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-	if(FragmentShaderStream.is_open()){
-		std::string Line = "";
-		while(getline(FragmentShaderStream, Line))
-			FragmentShaderCode += "\n" + Line;
-		FragmentShaderStream.close();
-	}
+GLuint compile_shader (GLenum type, const char* path, const std::string& code)
+{
+	GLuint ShaderID = glCreateShader(type);
+	printf("Compiling shader : %s\n", path);
+	char const * SourcePointer = code.c_str();
+	glShaderSource(ShaderID, 1, &SourcePointer , NULL);
+	glCompileShader(ShaderID);
+	return ShaderID;
+}
 
+/* Print the log of a shader, waiting for it to compile */
+void check_shader (GLuint ShaderID, const char* path)
+{
 	GLint Result = GL_FALSE;
 	int InfoLogLength;
+	glGetShaderiv(ShaderID, GL_COMPILE_STATUS, &Result);
+	glGetShaderiv(ShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+	if (Result != GL_TRUE || InfoLogLength > 1) {
+		std::vector<char> ShaderErrorMessage( max(InfoLogLength, int(1)) );
+		glGetShaderInfoLog(ShaderID, InfoLogLength, NULL, &ShaderErrorMessage[0]);
+		fprintf(stdout, "%s: %s\n", path, &ShaderErrorMessage[0]);
+	}
+}
+
+/* Submit a program: loaded from the program cache or compiled and linked */
+void program_start (ShaderProgram& program, const char * vertex_file_path, const char * fragment_file_path, void (*linked)(GLuint) = NULL)
+{
+	double StartTime = game_time();
+	program.Ready = program.Failed = 0;
+	program.VertexPath = vertex_file_path;
+	program.FragmentPath = fragment_file_path;
+	program.VertexShaderID = program.FragmentShaderID = 0;
+	program.CachePath = "";
+	program.StartTime = StartTime;
+	program.Linked = linked;
+	program.Number = shader_compiler.Started++;
+
+	std::string VertexShaderCode = read_shader(vertex_file_path);
+	std::string FragmentShaderCode = read_shader(fragment_file_path);
+
+	// Linked before with this driver?
+	int Cacheable = program_cache_usable();
+	if (Cacheable) {
+		program.CachePath = program_cache_path(VertexShaderCode, FragmentShaderCode);
+		program.ID = program_cache_load(program.CachePath);
+		if (program.ID) {
+			printf("Loaded cached program : %s + %s\n", vertex_file_path, fragment_file_path);
+			program.CachePath = "";
+			program_cache.Hits++;
+			shader_compiler.SubmitTime += game_time() - StartTime;
+			return;
+		}
+	}
+	program_cache.Misses++;
+
+	program.VertexShaderID = compile_shader(GL_VERTEX_SHADER, vertex_file_path, VertexShaderCode);
+	program.FragmentShaderID = compile_shader(GL_FRAGMENT_SHADER, fragment_file_path, FragmentShaderCode);
+
+	// Linked right away, the results are only looked at in program_finish()
+	program.ID = glCreateProgram();
+	glAttachShader(program.ID, program.VertexShaderID);
+	glAttachShader(program.ID, program.FragmentShaderID);
+	if (Cacheable)
+		glProgramParameteri(program.ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(program.ID);
+	shader_compiler.SubmitTime += game_time() - StartTime;
+}
+
+/* Wait for a program, check it and set it up */
+GLuint program_finish (ShaderProgram& program)
+{
+	if (program.Ready)
+		return program.ID;
+	double WaitStart = game_time();
+
+	if (program.VertexShaderID) {
+		check_shader(program.VertexShaderID, program.VertexPath);
+		check_shader(program.FragmentShaderID, program.FragmentPath);
+
+		// Check the program
+		GLint Result = GL_FALSE;
+		int InfoLogLength;
+		glGetProgramiv(program.ID, GL_LINK_STATUS, &Result);
+		glGetProgramiv(program.ID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+		if (Result != GL_TRUE || InfoLogLength > 1) {
+			std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
+			glGetProgramInfoLog(program.ID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
+			fprintf(stdout, "Linking %s + %s: %s\n", program.VertexPath, program.FragmentPath, &ProgramErrorMessage[0]);
+		}
+
+		glDeleteShader(program.VertexShaderID);
+		glDeleteShader(program.FragmentShaderID);
+		program.VertexShaderID = program.FragmentShaderID = 0;
+
+		program.Failed = Result != GL_TRUE;
+		if (!program.Failed && !program.CachePath.empty())
+			program_cache_store(program.CachePath, program.ID);
+	}
 
-	// Compile Vertex Shader
-	printf("Compiling shader : %s\n", vertex_file_path);
-	char const * VertexSourcePointer = VertexShaderCode.c_str();
-	glShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
-	glCompileShader(VertexShaderID);
-
-	// Check Vertex Shader
-	glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> VertexShaderErrorMessage(InfoLogLength);
-	glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
-	fprintf(stdout, "%s\n", &VertexShaderErrorMessage[0]);
-
-	// Compile Fragment Shader
-	printf("Compiling shader : %s\n", fragment_file_path);
-	char const * FragmentSourcePointer = FragmentShaderCode.c_str();
-	glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , NULL);
-	glCompileShader(FragmentShaderID);
-
-	// Check Fragment Shader
-	glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> FragmentShaderErrorMessage(InfoLogLength);
-	glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-	fprintf(stdout, "%s\n", &FragmentShaderErrorMessage[0]);
-
-	// Link the program
-	fprintf(stdout, "Linking program\n");
-	GLuint ProgramID = glCreateProgram();
-	glAttachShader(ProgramID, VertexShaderID);
-	glAttachShader(ProgramID, FragmentShaderID);
-	glLinkProgram(ProgramID);
-
-	// Check the program
-	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
-	glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
-	glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
-	fprintf(stdout, "%s\n", &ProgramErrorMessage[0]);
-
-	glDeleteShader(VertexShaderID);
-	glDeleteShader(FragmentShaderID);
-
-	return ProgramID;
+	double now = game_time();
+	printf("Program ready : %s + %s, %.1f ms after submitting, waited %.1f ms\n",
+	       program.VertexPath, program.FragmentPath, (now - program.StartTime)*1e3, (now - WaitStart)*1e3);
+	program.Ready = 1;
+	if (program.Linked)
+		program.Linked(program.ID);
+	return program.ID;
+}
+
+/* Done compiling and linking? Never waits when the driver compiles in parallel */
+int program_compiled (const ShaderProgram& program)
+{
+	if (program.Ready || !program.VertexShaderID || !shader_compiler.Parallel)
+		return 1;
+	GLint Done = GL_FALSE;
+	glGetProgramiv(program.ID, GL_COMPLETION_STATUS_ARB, &Done);
+	return Done;
+}
+
+/* Drop a program, finished or not */
+void program_discard (ShaderProgram& program)
+{
+	if (program.VertexShaderID) {
+		glDeleteShader(program.VertexShaderID);
+		glDeleteShader(program.FragmentShaderID);
+		program.VertexShaderID = program.FragmentShaderID = 0;
+	}
+	glDeleteProgram(program.ID);
+	program.ID = 0;
+	program.Ready = 0;
+}
+
+/* Function to load Shaders - Use it as it is, programs go through the program cache */
+GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+	ShaderProgram Program;
+	program_start(Program, vertex_file_path, fragment_file_path);
+	return program_finish(Program);
+}
+
+/* The program most things are drawn with */
+ShaderProgram main_program;
+
+void main_program_linked (GLuint program)
+{
+	programID = program;
+	// Get a handle for our "MVP" uniform
+	Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
 }
 
 static void error_callback(int error, const char* description)
@@ -176,214 +431,1539 @@ static void error_callback(int error, const char* description)
     fprintf(stderr, "Error: %s\n", description);
 }
 
-void quit(GLFWwindow *window)
+/*********************
+ * Software renderer *
+ *********************/
+/* --software swaps GL for a CPU rasterizer with the same contract as the
+   main program: solid colour triangles, fill and line modes, and an MVP
+   transform. Triangles are set up as edge functions and filled
+   4 pixels at a time with SSE2. It runs the whole game headless on any
+   Linux host, and its frames are a reference to compare GL output with. */
+struct SoftwareRenderer {
+    int Enabled;
+    int Width, Height;
+    int Stride;                 // pixels per row, rounded up to a multiple of 4
+    int ViewWidth, ViewHeight;  // the viewport, from the bottom left corner
+    vector<GLuint> pixels;      // RGBA8, bottom row first like glReadPixels
+    GLuint ClearColor;
+    glm::mat4 MVP;              // what the MVP uniform would hold, see set_mvp()
+    int Triangles;              // triangles drawn this frame
+} software;
+
+struct SwPoint {                // window coordinates, origin at the bottom left
+    float x, y;
+};
+
+GLuint sw_pack_color (GLubyte r, GLubyte g, GLubyte b)
 {
-    glfwDestroyWindow(window);
-    glfwTerminate();
-    exit(EXIT_SUCCESS);
+    GLubyte rgba[4] = {r, g, b, 255};
+    GLuint color;
+    memcpy(&color, rgba, sizeof(color));
+    return color;
 }
 
+void sw_init (int width, int height)
+{
+    software.Width = width;
+    software.Height = height;
+    software.ViewWidth = width;
+    software.ViewHeight = height;
+    software.Stride = (width + 3) & ~3;
+    software.pixels.assign(software.Stride*height, 0);
+    software.ClearColor = sw_pack_color(255, 255, 255);
+}
 
-/* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+void sw_clear ()
 {
-    struct VAO* vao = new struct VAO;
-    vao->PrimitiveMode = primitive_mode;
-    vao->NumVertices = numVertices;
-    vao->FillMode = fill_mode;
+    software.pixels.assign(software.pixels.size(), software.ClearColor);
+    software.Triangles = 0;
+}
 
-    // Create Vertex Array Object
-    // Should be done after CreateWindow and before any other GL calls
-    glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-    glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
-
-    glBindVertexArray (vao->VertexArrayID); // Bind the VAO
-    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
-    glVertexAttribPointer(
-                          0,                  // attribute 0. Vertices
-                          3,                  // size (x,y,z)
-                          GL_FLOAT,           // type
-                          GL_FALSE,           // normalized?
-                          0,                  // stride
-                          (void*)0            // array buffer offset
-                          );
-
-    glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
-    glVertexAttribPointer(
-                          1,                  // attribute 1. Color
-                          3,                  // size (r,g,b)
-                          GL_FLOAT,           // type
-                          GL_FALSE,           // normalized?
-                          0,                  // stride
-                          (void*)0            // array buffer offset
-                          );
+/* Tightly packed RGB of the frame, bottom row first */
+void sw_read_rgb (unsigned char* rgb)
+{
+    for (int y=0; y<software.Height; y++)
+        for (int x=0; x<software.Width; x++) {
+            const GLubyte* p = (const GLubyte*) &software.pixels[y*software.Stride + x];
+            memcpy(rgb + 3*(y*software.Width + x), p, 3);
+        }
+}
 
-    return vao;
+/* Vertex to window coordinates, through the viewport */
+SwPoint sw_transform (glm::mat4 MVP, const CompactVertex& v)
+{
+    glm::vec4 clip = MVP * glm::vec4(v.x, v.y, 0.0f, 1.0f);
+    SwPoint p = {(clip.x/clip.w + 1.0f)*0.5f*software.ViewWidth, (clip.y/clip.w + 1.0f)*0.5f*software.ViewHeight};
+    return p;
 }
 
-/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
+/* Edge function E(x,y) = A*x + B*y + C, positive inside a counter-clockwise triangle */
+struct SwEdge {
+    float A, B, C;
+    int TopLeft;                // pixels exactly on a top or left edge belong to the triangle
+};
+
+SwEdge sw_edge (SwPoint from, SwPoint to)
 {
-    GLfloat* color_buffer_data = new GLfloat [3*numVertices];
-    for (int i=0; i<numVertices; i++) {
-        color_buffer_data [3*i] = red;
-        color_buffer_data [3*i + 1] = green;
-        color_buffer_data [3*i + 2] = blue;
+    // Set up from the endpoints in a fixed order and negate, so the two
+    // triangles sharing an edge get exactly opposite values and no seam
+    int flip = to.x < from.x || (to.x == from.x && to.y < from.y);
+    if (flip)
+        swap(from, to);
+    SwEdge e;
+    e.A = from.y - to.y;
+    e.B = to.x - from.x;
+    e.C = -(e.A*from.x + e.B*from.y);
+    if (flip) {
+        e.A = -e.A;
+        e.B = -e.B;
+        e.C = -e.C;
+    }
+    e.TopLeft = e.A > 0 || (e.A == 0 && e.B < 0);
+    return e;
+}
+
+void sw_fill_triangle (SwPoint p0, SwPoint p1, SwPoint p2, GLuint color)
+{
+    float area = (p1.x - p0.x)*(p2.y - p0.y) - (p2.x - p0.x)*(p1.y - p0.y);
+    if (area == 0)
+        return;
+    if (area < 0)
+        swap(p1, p2);
+
+    // Pixel centres inside the clipped bounding box
+    int minx = max(0, (int) ceil(min(p0.x, min(p1.x, p2.x)) - 0.5f));
+    int maxx = min(software.ViewWidth - 1, (int) floor(max(p0.x, max(p1.x, p2.x)) - 0.5f));
+    int miny = max(0, (int) ceil(min(p0.y, min(p1.y, p2.y)) - 0.5f));
+    int maxy = min(software.ViewHeight - 1, (int) floor(max(p0.y, max(p1.y, p2.y)) - 0.5f));
+    if (minx > maxx || miny > maxy)
+        return;
+    minx &= ~3;     // whole groups of 4, the rows are padded to match
+
+    SwEdge e[3] = {sw_edge(p0, p1), sw_edge(p1, p2), sw_edge(p2, p0)};
+    software.Triangles++;
+
+#ifdef __SSE2__
+    __m128 lane = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+    __m128 zero = _mm_setzero_ps();
+    __m128i fill = _mm_set1_epi32(color);
+    __m128 four = _mm_set1_ps(4.0f);
+    __m128 A[3], topleft[3];
+    for (int k=0; k<3; k++) {
+        A[k] = _mm_set1_ps(e[k].A);
+        topleft[k] = _mm_castsi128_ps(_mm_set1_epi32(e[k].TopLeft ? -1 : 0));
+    }
+
+    for (int y=miny; y<=maxy; y++) {
+        float py = y + 0.5f;
+        __m128 rowE[3];
+        for (int k=0; k<3; k++)
+            rowE[k] = _mm_set1_ps(e[k].B*py + e[k].C);
+
+        // E is evaluated afresh for every group rather than stepped, stepping
+        // would round differently on the two sides of a shared edge
+        GLuint* row = &software.pixels[y*software.Stride];
+        __m128 px = _mm_add_ps(_mm_set1_ps((float) minx), lane);
+        for (int x=minx; x<=maxx; x+=4, px=_mm_add_ps(px, four)) {
+            __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+            for (int k=0; k<3; k++) {
+                __m128 E = _mm_add_ps(_mm_mul_ps(A[k], px), rowE[k]);
+                __m128 on_edge = _mm_and_ps(_mm_cmpeq_ps(E, zero), topleft[k]);
+                inside = _mm_and_ps(inside, _mm_or_ps(_mm_cmpgt_ps(E, zero), on_edge));
+            }
+            if (_mm_movemask_ps(inside)) {
+                __m128i mask = _mm_castps_si128(inside);
+                __m128i dst = _mm_loadu_si128((__m128i*) (row + x));
+                dst = _mm_or_si128(_mm_and_si128(mask, fill), _mm_andnot_si128(mask, dst));
+                _mm_storeu_si128((__m128i*) (row + x), dst);
+            }
+        }
+    }
+#else
+    for (int y=miny; y<=maxy; y++) {
+        float py = y + 0.5f;
+        GLuint* row = &software.pixels[y*software.Stride];
+        for (int x=minx; x<=maxx; x++) {
+            float px = x + 0.5f;
+            int inside = 1;
+            for (int k=0; k<3; k++) {
+                float E = e[k].A*px + (e[k].B*py + e[k].C);
+                inside &= E > 0 || (E == 0 && e[k].TopLeft);
+            }
+            if (inside)
+                row[x] = color;
+        }
+    }
+#endif
+}
+
+/* One pixel wide line, stepping along the major axis */
+void sw_line (SwPoint a, SwPoint b, GLuint color)
+{
+    float dx = b.x - a.x, dy = b.y - a.y;
+    int steps = (int) ceil(max(fabs(dx), fabs(dy)));
+    for (int i=0; i<=steps; i++) {
+        float t = steps ? (float) i/steps : 0.0f;
+        int x = (int) floor(a.x + t*dx), y = (int) floor(a.y + t*dy);
+        if (x >= 0 && x < software.ViewWidth && y >= 0 && y < software.ViewHeight)
+            software.pixels[y*software.Stride + x] = color;
     }
+}
 
-    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+/* Draw triangles of CompactVertex data, either plain triples or quads indexed (0,1,2) (2,3,0) */
+void sw_draw (const CompactVertex* vertices, int numVertices, int quads, glm::mat4 MVP, GLenum fill_mode)
+{
+    static const int quad_order[6] = {0, 1, 2, 2, 3, 0};
+    int numIndices = quads ? numVertices/4*6 : numVertices;
+
+    for (int t=0; t+2<numIndices; t+=3) {
+        const CompactVertex* v[3];
+        SwPoint p[3];
+        for (int k=0; k<3; k++) {
+            int i = quads ? 4*((t+k)/6) + quad_order[(t+k)%6] : t+k;
+            v[k] = &vertices[i];
+            p[k] = sw_transform(MVP, *v[k]);
+        }
+        // Solid colour triangles: the first vertex colours the whole triangle
+        GLuint color = sw_pack_color(v[0]->r, v[0]->g, v[0]->b);
+        if (fill_mode == GL_LINE) {
+            sw_line(p[0], p[1], color);
+            sw_line(p[1], p[2], color);
+            sw_line(p[2], p[0], color);
+        }
+        else
+            sw_fill_triangle(p[0], p[1], p[2], color);
+    }
 }
 
-/* Render the VBOs handled by VAO */
-void draw3DObject (struct VAO* vao)
+/* Load the MVP for the next draw with the main program */
+void set_mvp (glm::mat4 MVP)
 {
-    // Change the Fill Mode for this object
-    glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+    if (software.Enabled)
+        software.MVP = MVP;
+    else
+        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+}
 
-    // Bind the VAO to use
-    glBindVertexArray (vao->VertexArrayID);
+/*****************
+ * Headless mode *
+ *****************/
+/* --headless renders into an FBO of a surfaceless EGL context, so the game
+   runs on machines without a display or GPU (Mesa's software driver is
+   enough). Frames can be dumped as PPM and the achieved FPS is reported. */
+struct Headless {
+    int Enabled;
+    int Frames;             // frames to render before exiting
+    int DumpInterval;       // dump every Nth frame, 0 to never dump
+    string DumpPrefix;      // dumps are written to <prefix><frame>.ppm
+    int Width, Height;
+
+    EGLDisplay Display;
+    EGLContext Context;
+    GLuint Framebuffer;
+    GLuint ColorBuffer;
+    GLuint DepthBuffer;
 
-    // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray(0);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+    int FramesDone;
+    double StartTime;
+} headless = {0, 600, 0, "frame_"};
 
-    // Enable Vertex Attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+struct timespec clock_start;
 
-    // Draw the geometry !
-    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+/* Seconds since start-up - glfwGetTime() needs GLFW, which headless runs never initialise */
+double game_time ()
+{
+    if (!headless.Enabled)
+        return glfwGetTime();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - clock_start.tv_sec) + (now.tv_nsec - clock_start.tv_nsec)*1e-9;
 }
 
-/**************************
- * Customizable functions *
- **************************/
-float x_change = 0; //For the camera pan
-float y_change = 0; //For the camera pan
-float zoom_camera = 1;
-float brick_speed=-2,brick_dy=-0.5;
-float degree_per_rotation=1,partition=-190,lazer_speed=20,bucket_speed=10;
-double mouse_pos_x=0, mouse_pos_y=0;
-double new_mouse_pos_x=0, new_mouse_pos_y=0;
-double time_diff=0, current_time,old_time,laz_time,laz_old_time,m_col_time;
-COLOR col[3]={black,red,green};
-long long score=0,laz_no=0,mleft_click=0,mright_click=0,kleft_click=0,kright_click=0,ctrl=0,alt=0,mis_hit=6;
+/* Cursor position in window coordinates, left as it is when there is no window */
+void get_cursor_pos (GLFWwindow* window, double* x, double* y)
+{
+    if (window)
+        glfwGetCursorPos(window, x, y);
+}
 
-void create_lazer(int no);
-/* Executed when a regular key is pressed/released/held-down */
-void mousescroll(GLFWwindow* window, double xoffset, double yoffset)
+void initHeadless (int width, int height)
 {
-    if (yoffset==-1) {
-        zoom_camera /= 1.1; //make it bigger than current size
+    clock_gettime(CLOCK_MONOTONIC, &clock_start);
+    headless.Width = width;
+    headless.Height = height;
+    headless.FramesDone = 0;
+    headless.StartTime = game_time();
+
+    // The software renderer needs no context at all
+    if (software.Enabled) {
+        sw_init(width, height);
+        return;
     }
-    else if(yoffset==1){
-        zoom_camera *= 1.1; //make it bigger than current size
+
+    // Surfaceless Mesa display first, whatever the default display is otherwise
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    headless.Display = EGL_NO_DISPLAY;
+    if (getPlatformDisplay)
+        headless.Display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (headless.Display == EGL_NO_DISPLAY)
+        headless.Display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if (headless.Display == EGL_NO_DISPLAY || !eglInitialize(headless.Display, &major, &minor)) {
+        fprintf(stderr, "Error: could not initialise EGL\n");
+        exit(EXIT_FAILURE);
     }
-    if (zoom_camera<=1) {
-        zoom_camera = 1;
+    eglBindAPI(EGL_OPENGL_API);
+
+    EGLConfig config = EGL_NO_CONFIG_KHR;
+    const char* extensions = eglQueryString(headless.Display, EGL_EXTENSIONS);
+    if (!extensions || !strstr(extensions, "EGL_KHR_no_config_context")) {
+        EGLint config_attribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+        EGLint num_configs = 0;
+        eglChooseConfig(headless.Display, config_attribs, &config, 1, &num_configs);
     }
-    if (zoom_camera>=4) {
-        zoom_camera=4;
+
+    EGLint context_attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    headless.Context = eglCreateContext(headless.Display, config, EGL_NO_CONTEXT, context_attribs);
+    if (headless.Context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(headless.Display, EGL_NO_SURFACE, EGL_NO_SURFACE, headless.Context)) {
+        fprintf(stderr, "Error: could not create a surfaceless GL 3.3 context (0x%x)\n", eglGetError());
+        exit(EXIT_FAILURE);
     }
-    if(x_change-500.0f/zoom_camera<-500)
-        x_change=-500+500.0f/zoom_camera;
-    else if(x_change+500.0f/zoom_camera>500)
-        x_change=500-500.0f/zoom_camera;
-    if(y_change-350.0f/zoom_camera<-350)
-        y_change=-350+350.0f/zoom_camera;
-    else if(y_change+350.0f/zoom_camera>350)
-        y_change=350-350.0f/zoom_camera;
-    Matrices.projection = glm::ortho((float)(-500.0f/zoom_camera+x_change), (float)(500.0f/zoom_camera+x_change), (float)(-350.0f/zoom_camera+y_change), (float)(350.0f/zoom_camera+y_change), 0.1f, 500.0f);
+    gladLoadGLLoader((GLADloadproc) eglGetProcAddress);
+
+    // There is no default framebuffer, everything is drawn into this one
+    glGenFramebuffers(1, &headless.Framebuffer);
+    glGenRenderbuffers(1, &headless.ColorBuffer);
+    glGenRenderbuffers(1, &headless.DepthBuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, headless.Framebuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, headless.ColorBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, headless.ColorBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, headless.DepthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, headless.DepthBuffer);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "Error: headless framebuffer is incomplete\n");
+        exit(EXIT_FAILURE);
+    }
+    glViewport(0, 0, width, height);
 }
 
-//Ensure the panning does not go out of the map
-void check_pan(){
-    if(x_change-500.0f/zoom_camera<-500)
-        x_change=-500+500.0f/zoom_camera;
-    else if(x_change+500.0f/zoom_camera>500)
-        x_change=500-500.0f/zoom_camera;
-    if(y_change-350.0f/zoom_camera<-350)
-        y_change=-350+350.0f/zoom_camera;
-    else if(y_change+350.0f/zoom_camera>350)
-        y_change=350-350.0f/zoom_camera;
+/* Write the finished frame as a binary PPM, top row first */
+void headless_dump (const char* path)
+{
+    int w = headless.Width, h = headless.Height;
+    vector<unsigned char> pixels(3*w*h);
+    if (software.Enabled)
+        sw_read_rgb(&pixels[0]);
+    else {
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, w, h, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Error: could not write %s\n", path);
+        return;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", w, h);
+    for (int y=h-1; y>=0; y--)
+        fwrite(&pixels[3*w*y], 1, 3*w, file);
+    fclose(file);
 }
 
-/* Prefered for Keyboard events */
-void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+/* Stands in for the buffer swap */
+void headless_end_frame ()
 {
-    //for detecting multiple key press
-    glfwSetInputMode(window, GLFW_STICKY_KEYS, 1);
-     // Function is called first on GLFW_PRESS.
+    headless.FramesDone++;
+    if (headless.DumpInterval && headless.FramesDone % headless.DumpInterval == 0) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s%06d.ppm", headless.DumpPrefix.c_str(), headless.FramesDone);
+        headless_dump(path);
+    }
+    if (!software.Enabled)
+        glFlush();
+}
 
-    if (action == GLFW_RELEASE) {
-        switch (key) {
-            case GLFW_KEY_UP:
-                mousescroll(window,0,+1);
-                check_pan();
-                break;
-            case GLFW_KEY_DOWN:
-                mousescroll(window,0,-1);
-                check_pan();
-                break;
-            case GLFW_KEY_RIGHT:
-                kright_click=0;
-                x_change+=10;
-                check_pan();
-                break;
-            case GLFW_KEY_LEFT:
-                kleft_click=0;
-                x_change-=10;
-                check_pan();
-                break;
-            case GLFW_KEY_V:
-                y_change+=10;
-                check_pan();
-                break;
-            case GLFW_KEY_B:
-                y_change-=10;
-                check_pan();
-                break;
-            case GLFW_KEY_S:
-                cannon["main"].dy=0;
-                cannon["front"].dy=0;
-                cannon["main"].key_press=0;
-                cannon["front"].key_press=0;
-                break;
-            case GLFW_KEY_F:
-                cannon["main"].dy=0;
-                cannon["front"].dy=0;
-                cannon["main"].key_press=0;
-                cannon["front"].key_press=0;
-                break;
-            case GLFW_KEY_A:
-                cannon["front"].key_press=0;
-                break;
-            case GLFW_KEY_D:
-                cannon["front"].key_press=0;
-                break;
-            case GLFW_KEY_N:
-                if(brick_speed-brick_dy>-8)
-                  brick_speed+=brick_dy;
-                break;
-            case GLFW_KEY_M:
-                if(brick_speed-brick_dy<-2)
-                  brick_speed-=brick_dy;
-                break;
-            case GLFW_KEY_SPACE:
-                if(current_time-laz_old_time>1)
-                {
-                  create_lazer(laz_no/2);
-                  laz_no++;
-                  laz_old_time=current_time;
+/* Report the achieved frame rate and release the context */
+void headless_finish ()
+{
+    if (software.Enabled) {
+        double elapsed = game_time() - headless.StartTime;
+        printf("Software: %d frames in %.3f s, %.1f FPS\n", headless.FramesDone, elapsed,
+               elapsed > 0 ? headless.FramesDone/elapsed : 0.0);
+        return;
+    }
+    glFinish();
+    double elapsed = game_time() - headless.StartTime;
+    printf("Headless: %d frames in %.3f s, %.1f FPS\n", headless.FramesDone, elapsed,
+           elapsed > 0 ? headless.FramesDone/elapsed : 0.0);
+    eglMakeCurrent(headless.Display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(headless.Display, headless.Context);
+    eglTerminate(headless.Display);
+}
+
+/*****************
+ * Frame capture *
+ *****************/
+/* --capture records every frame without stalling the main loop: the frame
+   is read into one of a ring of pixel buffer objects and only mapped
+   Latency frames later, when the copy has long finished. The mapped pixels
+   are handed to a worker thread, which converts and writes them, as Y4M
+   when the file name ends in .y4m and as raw RGBA frames otherwise. */
+#define CAPTURE_POOL 8          // frames queued for the worker before the main loop waits
+
+struct Capture {
+    int Enabled;
+    string Path;
+    int Latency;                // frames between reading a frame and mapping it
+    int Y4M;
+    int Width, Height;
+    FILE* File;
+    vector<GLuint> PBOs;        // ring of Latency+1 pack buffers
+    long Frames;                // frames read so far
+    long Written;               // frames written by the worker
+    double TotalTime, MaxTime;  // main loop time spent capturing, not counting waits
+    double WaitTime;            // time the current frame waited for a spare buffer
+    long Stalls;                // frames that had to wait for the worker
+
+    pthread_t Worker;
+    pthread_mutex_t Lock;
+    pthread_cond_t Ready;       // a frame was queued, or capture is stopping
+    pthread_cond_t Free;        // the worker gave a buffer back
+    vector<unsigned char*> queue;   // frames waiting for the worker, oldest first
+    vector<unsigned char*> pool;    // spare frame buffers
+    int Stopping;
+} capture = {0, "", 2};
+
+/* 128 plus a chroma sum over a 2x2 block, scaled by 1024. The shift
+   rounds negative sums to nearest as well, and saturated red or blue
+   comes to 256, which must not wrap to 0. */
+unsigned char capture_chroma (int sum)
+{
+    int c = ((sum + 512) >> 10) + 128;
+    return (unsigned char) (c < 0 ? 0 : c > 255 ? 255 : c);
+}
+
+/* RGBA rows, bottom row first, to 4:2:0 BT.601 full range planes, top row first */
+void capture_to_yuv (const unsigned char* rgba, int w, int h, vector<unsigned char>& planes)
+{
+    int cw = (w + 1)/2, ch = (h + 1)/2;
+    planes.resize(w*h + 2*cw*ch);
+    unsigned char* Y = &planes[0];
+    unsigned char* U = Y + w*h;
+    unsigned char* V = U + cw*ch;
+
+    for (int y=0; y<h; y++) {
+        const unsigned char* row = rgba + 4*w*(h - 1 - y);
+        for (int x=0; x<w; x++) {
+            const unsigned char* p = row + 4*x;
+            Y[y*w + x] = (unsigned char) ((77*p[0] + 150*p[1] + 29*p[2] + 128) >> 8);
+        }
+    }
+    for (int y=0; y<ch; y++)
+        for (int x=0; x<cw; x++) {
+            // Average the 2x2 block, clamped at odd edges
+            int r = 0, g = 0, b = 0;
+            for (int dy=0; dy<2; dy++)
+                for (int dx=0; dx<2; dx++) {
+                    int sx = min(2*x + dx, w - 1), sy = min(2*y + dy, h - 1);
+                    const unsigned char* p = rgba + 4*(w*(h - 1 - sy) + sx);
+                    r += p[0]; g += p[1]; b += p[2];
                 }
-                break;
-            case GLFW_KEY_LEFT_CONTROL:
-                ctrl=0;
+            U[y*cw + x] = capture_chroma(-43*r - 85*g + 128*b);
+            V[y*cw + x] = capture_chroma(128*r - 107*g - 21*b);
+        }
+}
+
+void capture_write_y4m (const unsigned char* rgba, vector<unsigned char>& planes)
+{
+    capture_to_yuv(rgba, capture.Width, capture.Height, planes);
+    fputs("FRAME\n", capture.File);
+    fwrite(&planes[0], 1, planes.size(), capture.File);
+}
+
+void* capture_worker (void*)
+{
+    vector<unsigned char> planes;
+    pthread_mutex_lock(&capture.Lock);
+    while (true) {
+        while (capture.queue.empty() && !capture.Stopping)
+            pthread_cond_wait(&capture.Ready, &capture.Lock);
+        if (capture.queue.empty())
+            break;
+        unsigned char* frame = capture.queue.front();
+        capture.queue.erase(capture.queue.begin());
+        pthread_mutex_unlock(&capture.Lock);
+
+        if (capture.Y4M)
+            capture_write_y4m(frame, planes);
+        else
+            fwrite(frame, 1, 4*capture.Width*capture.Height, capture.File);
+
+        pthread_mutex_lock(&capture.Lock);
+        capture.pool.push_back(frame);
+        capture.Written++;
+        pthread_cond_signal(&capture.Free);
+    }
+    pthread_mutex_unlock(&capture.Lock);
+    return NULL;
+}
+
+/* Pure red and pure blue frames must keep their saturated chroma */
+void capture_check_yuv ()
+{
+    const unsigned char colors[2][4] = {{255, 0, 0, 255}, {0, 0, 255, 255}};
+    const int expected[2][2] = {{85, 255}, {255, 107}};     // U, V
+    vector<unsigned char> planes;
+    for (int c=0; c<2; c++) {
+        unsigned char rgba[16];
+        for (int i=0; i<16; i++)
+            rgba[i] = colors[c][i % 4];
+        capture_to_yuv(rgba, 2, 2, planes);
+        if (planes[4] != expected[c][0] || planes[5] != expected[c][1]) {
+            fprintf(stderr, "Error: %s converts to U %d V %d, expected U %d V %d\n", c ? "blue" : "red",
+                    planes[4], planes[5], expected[c][0], expected[c][1]);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void capture_init (int width, int height)
+{
+    capture.Width = width;
+    capture.Height = height;
+    capture.File = fopen(capture.Path.c_str(), "wb");
+    if (!capture.File) {
+        fprintf(stderr, "Error: could not write %s\n", capture.Path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    size_t n = capture.Path.size();
+    capture.Y4M = n >= 4 && capture.Path.compare(n - 4, 4, ".y4m") == 0;
+    if (capture.Y4M) {
+        capture_check_yuv();
+        fprintf(capture.File, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C420jpeg\n", width, height);
+    }
+
+    for (int i=0; i<CAPTURE_POOL; i++)
+        capture.pool.push_back(new unsigned char[4*width*height]);
+
+    // The software renderer hands its pixels over directly
+    if (!software.Enabled) {
+        capture.PBOs.resize(capture.Latency + 1);
+        glGenBuffers(capture.PBOs.size(), &capture.PBOs[0]);
+        for (size_t i=0; i<capture.PBOs.size(); i++) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.PBOs[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, 4*width*height, NULL, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    pthread_mutex_init(&capture.Lock, NULL);
+    pthread_cond_init(&capture.Ready, NULL);
+    pthread_cond_init(&capture.Free, NULL);
+    pthread_create(&capture.Worker, NULL, capture_worker, NULL);
+}
+
+/* Take a spare buffer, waiting for the worker when it is behind */
+unsigned char* capture_acquire ()
+{
+    pthread_mutex_lock(&capture.Lock);
+    if (capture.pool.empty()) {
+        double start = game_time();
+        capture.Stalls++;
+        while (capture.pool.empty())
+            pthread_cond_wait(&capture.Free, &capture.Lock);
+        capture.WaitTime += game_time() - start;
+    }
+    unsigned char* frame = capture.pool.back();
+    capture.pool.pop_back();
+    pthread_mutex_unlock(&capture.Lock);
+    return frame;
+}
+
+void capture_submit (unsigned char* frame)
+{
+    pthread_mutex_lock(&capture.Lock);
+    capture.queue.push_back(frame);
+    pthread_cond_signal(&capture.Ready);
+    pthread_mutex_unlock(&capture.Lock);
+}
+
+/* Map the PBO read Latency frames ago and queue its pixels */
+void capture_map (GLuint pbo)
+{
+    unsigned char* frame = capture_acquire();
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+    void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, 4*capture.Width*capture.Height, GL_MAP_READ_BIT);
+    if (pixels) {
+        memcpy(frame, pixels, 4*capture.Width*capture.Height);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    capture_submit(frame);
+}
+
+/* Called once the frame is drawn, before it is swapped */
+void capture_frame ()
+{
+    double start = game_time();
+    capture.WaitTime = 0;
+    if (software.Enabled) {
+        unsigned char* frame = capture_acquire();
+        for (int y=0; y<capture.Height; y++)
+            memcpy(frame + 4*capture.Width*y, &software.pixels[y*software.Stride], 4*capture.Width);
+        capture_submit(frame);
+    }
+    else {
+        int slot = capture.Frames % capture.PBOs.size();
+        // The slot about to be reused was read Latency frames ago
+        if (capture.Frames >= capture.Latency)
+            capture_map(capture.PBOs[(capture.Frames - capture.Latency) % capture.PBOs.size()]);
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.PBOs[slot]);
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        glReadPixels(0, 0, capture.Width, capture.Height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+    capture.Frames++;
+
+    double elapsed = game_time() - start - capture.WaitTime;
+    capture.TotalTime += elapsed;
+    capture.MaxTime = max(capture.MaxTime, elapsed);
+}
+
+/* Collect the frames still in flight and wait for the worker to write them */
+void capture_finish ()
+{
+    if (!software.Enabled)
+        for (long f=max(0L, capture.Frames - capture.Latency); f<capture.Frames; f++)
+            capture_map(capture.PBOs[f % capture.PBOs.size()]);
+
+    pthread_mutex_lock(&capture.Lock);
+    capture.Stopping = 1;
+    pthread_cond_signal(&capture.Ready);
+    pthread_mutex_unlock(&capture.Lock);
+    pthread_join(capture.Worker, NULL);
+    fclose(capture.File);
+
+    printf("Capture: %ld frames to %s, %.3f ms average, %.3f ms worst per frame, %ld waited on the writer\n",
+           capture.Written, capture.Path.c_str(), capture.Frames ? 1000*capture.TotalTime/capture.Frames : 0.0,
+           1000*capture.MaxTime, capture.Stalls);
+    if (!software.Enabled)
+        glDeleteBuffers(capture.PBOs.size(), &capture.PBOs[0]);
+    for (size_t i=0; i<capture.pool.size(); i++)
+        delete[] capture.pool[i];
+    capture.pool.clear();
+}
+
+void render_thread_stop ();
+void profiler_finish ();
+void pacing_finish ();
+void input_latency_finish ();
+void particles_finish ();
+void background_finish ();
+
+void quit(GLFWwindow *window)
+{
+    render_thread_stop();
+    profiler_finish();
+    pacing_finish();
+    input_latency_finish();
+    particles_finish();
+    background_finish();
+    if (capture.Enabled)
+        capture_finish();
+    if (headless.Enabled) {
+        headless_finish();
+        exit(EXIT_SUCCESS);
+    }
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    exit(EXIT_SUCCESS);
+}
+
+
+/*******************
+ * GL state cache  *
+ *******************/
+/* Thin filter in front of the state calls made on every draw. A call that
+   would set what is already current is dropped and counted instead, which
+   saves the driver its validation work. All binds below go through here. */
+struct GLStateCache {
+    GLuint Program;
+    GLuint VertexArray;
+    GLuint ArrayBuffer;
+    GLenum PolygonMode;
+
+    int Issued;             // state calls passed on to GL this frame
+    int Filtered;           // redundant state calls dropped this frame
+    int LastIssued;         // totals of the last finished frame
+    int LastFiltered;
+} gl_state = {0, 0, 0, GL_FILL, 0, 0, 0, 0};   // GL defaults of a new context
+
+void state_use_program (GLuint program)
+{
+    if (gl_state.Program == program) {
+        gl_state.Filtered++;
+        return;
+    }
+    glUseProgram (program);
+    gl_state.Program = program;
+    gl_state.Issued++;
+}
+
+/* Bind a program, finishing it on its first use */
+void program_use (ShaderProgram& program)
+{
+    state_use_program (program_finish(program));
+}
+
+void state_bind_vertex_array (GLuint vertex_array)
+{
+    if (gl_state.VertexArray == vertex_array) {
+        gl_state.Filtered++;
+        return;
+    }
+    glBindVertexArray (vertex_array);
+    gl_state.VertexArray = vertex_array;
+    gl_state.Issued++;
+}
+
+void state_bind_array_buffer (GLuint buffer)
+{
+    if (gl_state.ArrayBuffer == buffer) {
+        gl_state.Filtered++;
+        return;
+    }
+    glBindBuffer (GL_ARRAY_BUFFER, buffer);
+    gl_state.ArrayBuffer = buffer;
+    gl_state.Issued++;
+}
+
+void state_polygon_mode (GLenum mode)
+{
+    if (gl_state.PolygonMode == mode) {
+        gl_state.Filtered++;
+        return;
+    }
+    glPolygonMode (GL_FRONT_AND_BACK, mode);
+    gl_state.PolygonMode = mode;
+    gl_state.Issued++;
+}
+
+/* Roll the per frame counters over, call once after each frame */
+void state_cache_end_frame ()
+{
+    gl_state.LastIssued = gl_state.Issued;
+    gl_state.LastFiltered = gl_state.Filtered;
+    gl_state.Issued = 0;
+    gl_state.Filtered = 0;
+}
+
+GLshort quantize_position (float v)
+{
+    float q = floor(v*POSITION_SCALE + 0.5f);
+    return (GLshort) max(-32768.0f, min(32767.0f, q));
+}
+
+GLubyte quantize_color (float c)
+{
+    return (GLubyte) max(0.0f, min(255.0f, floor(c*255.0f + 0.5f)));
+}
+
+/* Undo the fixed point scale of CompactVertex positions; compose it into the MVP */
+glm::mat4 dequantize_matrix ()
+{
+    return glm::scale(glm::vec3(1.0f/POSITION_SCALE, 1.0f/POSITION_SCALE, 1.0f));
+}
+
+/* Point attributes 0 and 1 of the bound VAO at CompactVertex data in the bound VBO */
+void compact_vertex_attributes (GLintptr offset = 0)
+{
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_SHORT, GL_FALSE, sizeof(CompactVertex), (void*)offset);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(CompactVertex), (void*)(offset + 2*sizeof(GLshort)));
+}
+
+/* Quads are 4 vertices indexed as two triangles (0,1,2) (2,3,0). One index
+   buffer holding that pattern is shared by every quad mesh and the batch. */
+#define MAX_QUADS_PER_DRAW 16384    // 65536 vertices, the reach of GLushort indices
+GLuint quad_index_buffer = 0;
+
+GLuint quad_indices ()
+{
+    if (quad_index_buffer)
+        return quad_index_buffer;
+
+    vector<GLushort> indices(6*MAX_QUADS_PER_DRAW);
+    for (int q=0; q<MAX_QUADS_PER_DRAW; q++) {
+        indices[6*q]     = 4*q;
+        indices[6*q + 1] = 4*q + 1;
+        indices[6*q + 2] = 4*q + 2;
+        indices[6*q + 3] = 4*q + 2;
+        indices[6*q + 4] = 4*q + 3;
+        indices[6*q + 5] = 4*q;
+    }
+    glGenBuffers (1, &quad_index_buffer);
+    glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, quad_index_buffer);
+    glBufferData (GL_ELEMENT_ARRAY_BUFFER, indices.size()*sizeof(GLushort), &indices[0], GL_STATIC_DRAW);
+    return quad_index_buffer;
+}
+
+/* Generate VAO, VBO and return VAO handle - numQuads > 0 makes an indexed quad mesh */
+struct VAO* create2DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode, int numQuads)
+{
+    struct VAO* vao = new struct VAO;
+    vao->PrimitiveMode = primitive_mode;
+    vao->NumVertices = numVertices;
+    vao->NumIndices = 6*numQuads;
+    vao->FillMode = fill_mode;
+
+    // Interleave and pack the vertices, the copy is kept for the sprite batch
+    vao->Vertices = new CompactVertex [numVertices];
+    for (int i=0; i<numVertices; i++) {
+        vao->Vertices[i].x = quantize_position(vertex_buffer_data[3*i]);
+        vao->Vertices[i].y = quantize_position(vertex_buffer_data[3*i + 1]);
+        vao->Vertices[i].r = quantize_color(color_buffer_data[3*i]);
+        vao->Vertices[i].g = quantize_color(color_buffer_data[3*i + 1]);
+        vao->Vertices[i].b = quantize_color(color_buffer_data[3*i + 2]);
+        vao->Vertices[i].a = 255;
+    }
+    vao->MinX = vao->MaxX = vertex_buffer_data[0];
+    vao->MinY = vao->MaxY = vertex_buffer_data[1];
+    for (int i=1; i<numVertices; i++) {
+        vao->MinX = min(vao->MinX, vertex_buffer_data[3*i]);
+        vao->MaxX = max(vao->MaxX, vertex_buffer_data[3*i]);
+        vao->MinY = min(vao->MinY, vertex_buffer_data[3*i + 1]);
+        vao->MaxY = max(vao->MaxY, vertex_buffer_data[3*i + 1]);
+    }
+
+    // The GL side is made on first draw, by the thread owning the context
+    return vao;
+}
+
+/* Generate VAO, VBOs and return VAO handle */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+{
+    return create2DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode, 0);
+}
+
+/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
+{
+    GLfloat* color_buffer_data = new GLfloat [3*numVertices];
+    for (int i=0; i<numVertices; i++) {
+        color_buffer_data [3*i] = red;
+        color_buffer_data [3*i + 1] = green;
+        color_buffer_data [3*i + 2] = blue;
+    }
+
+    struct VAO* vao = create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+    delete [] color_buffer_data;
+    return vao;
+}
+
+/* Generate an indexed quad mesh - 4 vertices a quad, in (0,1,2) (2,3,0) order */
+struct VAO* createQuadObject (int numQuads, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+{
+    return create2DObject(GL_TRIANGLES, 4*numQuads, vertex_buffer_data, color_buffer_data, fill_mode, numQuads);
+}
+
+/*****************
+ * Stream buffer *
+ *****************/
+/* Data that changes every frame (batched sprite vertices, brick, laser and
+   glyph instances) is written straight into one buffer that stays mapped,
+   made with GL_ARB_buffer_storage as persistent and coherent. It is split in
+   STREAM_REGIONS regions used in turn, one per frame, and a fence after each
+   frame's draws tells when its region may be written again, so the buffer is
+   never specified again and the driver has nothing to wait for. GL 3.3
+   contexts orphan it at the start of each frame instead, and map what each
+   draw needs unsynchronized. It grows when a frame does not fit. */
+#define STREAM_REGIONS 3
+
+struct StreamBuffer {
+    GLuint Buffer;
+    int Generation;             // bumped whenever Buffer is made again
+    int Persistent;             // mapped for good, else orphaned every frame
+    GLsizeiptr RegionSize;
+    char* Mapped;               // the whole buffer, when persistent
+    int Region;                 // the one written this frame
+    GLsizeiptr Used;            // bytes of it written this frame
+    GLsync fences[STREAM_REGIONS];
+} stream;
+
+void stream_allocate (GLsizeiptr region_size)
+{
+    if (stream.Buffer) {
+        // Draws already sent keep the old storage alive until they are done
+        state_bind_array_buffer (stream.Buffer);
+        if (stream.Persistent)
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+        glDeleteBuffers(1, &stream.Buffer);
+        gl_state.ArrayBuffer = 0;
+        for (int r=0; r<STREAM_REGIONS; r++)
+            if (stream.fences[r]) {
+                glDeleteSync(stream.fences[r]);
+                stream.fences[r] = 0;
+            }
+        printf("Stream buffer: grown to %ld KB a frame\n", (long) region_size/1024);
+    }
+    stream.RegionSize = region_size;
+    stream.Region = 0;
+    stream.Used = 0;
+    stream.Generation++;
+
+    glGenBuffers(1, &stream.Buffer);
+    state_bind_array_buffer (stream.Buffer);
+    if (stream.Persistent) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, STREAM_REGIONS*region_size, NULL, flags);
+        stream.Mapped = (char*) glMapBufferRange(GL_ARRAY_BUFFER, 0, STREAM_REGIONS*region_size, flags);
+    }
+    else
+        glBufferData(GL_ARRAY_BUFFER, region_size, NULL, GL_STREAM_DRAW);
+}
+
+void stream_init ()
+{
+    if (software.Enabled)
+        return;
+    stream.Persistent = GLAD_GL_VERSION_4_4 || GLAD_GL_ARB_buffer_storage;
+    stream_allocate(256*1024);
+    printf("Stream buffer: %s, %d KB a frame\n", stream.Persistent ? "persistent mapped" : "orphaned", (int) stream.RegionSize/1024);
+}
+
+/* Room for size bytes aligned to align, in this frame's part of the stream
+   buffer, which is left bound to GL_ARRAY_BUFFER. Returns where to write
+   them and sets offset to their place in the buffer. stream_unmap() must
+   follow before drawing from them. */
+void* stream_map (GLsizeiptr size, GLsizeiptr align, GLintptr* offset)
+{
+    GLsizeiptr start = (stream.Used + align - 1) / align * align;
+    if (start + size > stream.RegionSize) {
+        if (stream.Persistent || size > stream.RegionSize)
+            stream_allocate(max(2*stream.RegionSize, 2*size));
+        start = 0;
+    }
+    state_bind_array_buffer (stream.Buffer);
+    stream.Used = start + size;
+
+    if (stream.Persistent) {
+        *offset = stream.Region*stream.RegionSize + start;
+        return stream.Mapped + *offset;
+    }
+    // The first data of a frame, or of a full buffer, gets new storage
+    *offset = start;
+    if (start == 0)
+        glBufferData(GL_ARRAY_BUFFER, stream.RegionSize, NULL, GL_STREAM_DRAW);
+    return glMapBufferRange(GL_ARRAY_BUFFER, start, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+}
+
+void stream_unmap ()
+{
+    if (stream.Persistent)
+        return;             // coherent, the GPU sees the writes as they are
+    state_bind_array_buffer (stream.Buffer);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+}
+
+/* Fence the frame's region and move on to the next one, once the GPU is done with it */
+void stream_end_frame ()
+{
+    if (software.Enabled)
+        return;
+    stream.Used = 0;
+    if (!stream.Persistent)
+        return;
+    stream.fences[stream.Region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    stream.Region = (stream.Region + 1) % STREAM_REGIONS;
+
+    GLsync fence = stream.fences[stream.Region];
+    if (!fence)
+        return;
+    while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+    glDeleteSync(fence);
+    stream.fences[stream.Region] = 0;
+}
+
+/**********************
+ * Dynamic resolution *
+ **********************/
+/* --dynamic-resolution FPS draws the game into part of an offscreen texture
+   and stretches that over the window with one linearly filtered quad. The
+   part shrinks when frames take longer than 1/FPS to draw, and grows back
+   when there is time to spare; at full size the frame is drawn straight to
+   the window. Frame time, the upscale included, comes from GPU timestamps
+   read back a few frames later, so vsync waits do not count, or from the
+   CPU with --software. The HUD is drawn after the upscale, at full
+   resolution. reshapeWindow() only notes the window size, the render
+   thread, which owns the context, sets the viewport up for it. */
+#define RESOLUTION_QUERIES 4        // frames of timestamps in flight
+#define RESOLUTION_MIN_SCALE 0.25f
+
+struct DynamicResolution {
+    int Enabled;
+    float TargetMS;                 // frame time to stay under
+    int Width, Height;              // window framebuffer, set on the main thread
+
+    // Render thread
+    int OutputWidth, OutputHeight;  // what the viewport and target are set up for
+    float Scale;                    // of each side of the frame
+    float FrameMS;                  // smoothed draw time
+    int ViewWidth, ViewHeight;      // drawn this frame
+    int Presented;                  // scaled up to the output yet?
+    ShaderProgram Program;          // draws the frame texture over the output
+    GLuint ScaleID;                 // "scale" uniform of the program
+    GLuint VertexArrayID;           // no attributes, the corners come from gl_VertexID
+    GLuint Framebuffer, ColorTexture;
+    GLuint queries[RESOLUTION_QUERIES][2];  // timestamps at the start and the upscale
+    int Issued, Read;               // frames queried and read back
+    double StartTime;               // of the frame, for the software renderer
+} resolution = {0, 1000.0f/60, 1000, 700, 0, 0, 1};
+
+void resolution_linked (GLuint program)
+{
+    resolution.ScaleID = glGetUniformLocation(program, "scale");
+    state_use_program(program);
+    glUniform1i(glGetUniformLocation(program, "frame"), 3);
+}
+
+void resolution_init ()
+{
+    if (!resolution.Enabled || software.Enabled)
+        return;
+    program_start(resolution.Program, "Sample_GL_upscale.vert", "Sample_GL_upscale.frag", resolution_linked);
+    glGenVertexArrays(1, &resolution.VertexArrayID);
+    glGenFramebuffers(1, &resolution.Framebuffer);
+    glGenQueries(2*RESOLUTION_QUERIES, &resolution.queries[0][0]);
+
+    // Texture unit 3 keeps the frame, its size is set by resolution_begin_frame()
+    glGenTextures(1, &resolution.ColorTexture);
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_2D, resolution.ColorTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+/* Feed the time the last frame took to draw to the scale */
+void resolution_update (float ms)
+{
+    resolution.FrameMS = resolution.FrameMS ? 0.8f*resolution.FrameMS + 0.2f*ms : ms;
+
+    // Pixel cost follows the area, so each side goes with the square root.
+    // Shrink quickly when late, grow back slowly once well within the target.
+    float scale = resolution.Scale * sqrt(resolution.TargetMS / resolution.FrameMS);
+    if (resolution.FrameMS > resolution.TargetMS)
+        scale = max(scale, 0.8f*resolution.Scale);
+    else if (resolution.FrameMS < 0.75f*resolution.TargetMS)
+        scale = min(scale, 1.05f*resolution.Scale);
+    else
+        return;
+    resolution.Scale = max(RESOLUTION_MIN_SCALE, min(1.0f, scale));
+}
+
+/* Timestamps of the frames the GPU has finished, oldest first, never waits */
+void resolution_read_queries ()
+{
+    while (resolution.Read < resolution.Issued) {
+        GLuint* q = resolution.queries[resolution.Read % RESOLUTION_QUERIES];
+        GLint available = 0;
+        glGetQueryObjectiv(q[1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            return;
+        GLuint64 start, end;
+        glGetQueryObjectui64v(q[0], GL_QUERY_RESULT, &start);
+        glGetQueryObjectui64v(q[1], GL_QUERY_RESULT, &end);
+        resolution_update((end - start) / 1e6f);
+        resolution.Read++;
+    }
+}
+
+/* Set the frame up for the output size of the frame being drawn */
+void resolution_begin_frame (int width, int height)
+{
+    GLuint output = headless.Enabled ? headless.Framebuffer : 0;
+    if (width != resolution.OutputWidth || height != resolution.OutputHeight) {
+        resolution.OutputWidth = width;
+        resolution.OutputHeight = height;
+        if (resolution.Enabled && !software.Enabled) {
+            glActiveTexture(GL_TEXTURE3);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+            glActiveTexture(GL_TEXTURE0);
+            glBindFramebuffer(GL_FRAMEBUFFER, resolution.Framebuffer);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, resolution.ColorTexture, 0);
+            glBindFramebuffer(GL_FRAMEBUFFER, output);
+        }
+        else if (!software.Enabled)
+            glViewport(0, 0, width, height);
+    }
+
+    resolution.Presented = 1;
+    if (!resolution.Enabled)
+        return;
+    resolution.ViewWidth = max(1, (int) (width*resolution.Scale + 0.5f));
+    resolution.ViewHeight = max(1, (int) (height*resolution.Scale + 0.5f));
+    // At full size it is drawn straight to the output, with nothing to scale up
+    resolution.Presented = resolution.ViewWidth == width && resolution.ViewHeight == height;
+
+    if (software.Enabled) {
+        software.ViewWidth = resolution.ViewWidth;
+        software.ViewHeight = resolution.ViewHeight;
+        resolution.StartTime = game_time();
+        return;
+    }
+    resolution_read_queries();
+    if (resolution.Issued - resolution.Read == RESOLUTION_QUERIES)
+        resolution.Read++;      // the GPU is that far behind, skip the oldest
+    glQueryCounter(resolution.queries[resolution.Issued % RESOLUTION_QUERIES][0], GL_TIMESTAMP);
+    glBindFramebuffer(GL_FRAMEBUFFER, resolution.Presented ? output : resolution.Framebuffer);
+    glViewport(0, 0, resolution.ViewWidth, resolution.ViewHeight);
+}
+
+/* Scale what was drawn so far up to the whole output, what follows is drawn at full size */
+void resolution_present ()
+{
+    if (resolution.Presented)
+        return;
+    resolution.Presented = 1;
+    int w = resolution.OutputWidth, h = resolution.OutputHeight;
+    int vw = resolution.ViewWidth, vh = resolution.ViewHeight;
+
+    if (software.Enabled) {
+        // In place, from the top right down: a pixel only reads from below and left of itself
+        GLuint* pixels = &software.pixels[0];
+        for (int y=h-1; y>=0; y--) {
+            const GLuint* from = pixels + y*vh/h*software.Stride;
+            GLuint* to = pixels + y*software.Stride;
+            for (int x=w-1; x>=0; x--)
+                to[x] = from[x*vw/w];
+        }
+        software.ViewWidth = w;
+        software.ViewHeight = h;
+        return;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, headless.Enabled ? headless.Framebuffer : 0);
+    glViewport(0, 0, w, h);
+    state_bind_vertex_array (resolution.VertexArrayID);
+    program_use (resolution.Program);
+    glUniform2f(resolution.ScaleID, (float) vw/w, (float) vh/h);
+    state_polygon_mode (GL_FILL);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+}
+
+/* The frame is drawn, upscale included: time it */
+void resolution_end_frame ()
+{
+    if (!resolution.Enabled)
+        return;
+    if (software.Enabled)
+        resolution_update((game_time() - resolution.StartTime) * 1000);
+    else {
+        glQueryCounter(resolution.queries[resolution.Issued % RESOLUTION_QUERIES][1], GL_TIMESTAMP);
+        resolution.Issued++;
+    }
+}
+
+/*************
+ * Culling   *
+ *************/
+/* Sprites are tested against the view before anything is recorded for
+   them: the corners of their bounding box go through the frame's VP, and
+   the sprite is skipped when the box misses the clip square. Zoomed in,
+   most of the field is off screen and costs nothing to draw. */
+struct Culling {
+    glm::mat4 VP;
+    int Tested, Culled;             // this frame
+    int LastTested, LastCulled;     // the previous frame, for show_stats()
+} culling;
+
+void cull_begin (glm::mat4 VP)
+{
+    culling.LastTested = culling.Tested;
+    culling.LastCulled = culling.Culled;
+    culling.VP = VP;
+    culling.Tested = 0;
+    culling.Culled = 0;
+}
+
+/* Is the box min..max, placed by the model matrix, at least partly in view? */
+int cull_visible (glm::mat4 model, float minx, float miny, float maxx, float maxy)
+{
+    glm::mat4 MVP = culling.VP * model;
+    float lox = 1e30f, loy = 1e30f, hix = -1e30f, hiy = -1e30f;
+    for (int k=0; k<4; k++) {
+        glm::vec4 corner = MVP * glm::vec4(k & 1 ? maxx : minx, k & 2 ? maxy : miny, 0.0f, 1.0f);
+        lox = min(lox, corner.x/corner.w);
+        hix = max(hix, corner.x/corner.w);
+        loy = min(loy, corner.y/corner.w);
+        hiy = max(hiy, corner.y/corner.w);
+    }
+    culling.Tested++;
+    if (hix < -1 || lox > 1 || hiy < -1 || loy > 1) {
+        culling.Culled++;
+        return 0;
+    }
+    return 1;
+}
+
+/*******************
+ * Render commands *
+ *******************/
+/* draw() only simulates and records: the sprite batch, the brick renderer
+   and the static scene append commands to render_commands instead of
+   calling GL, and the render thread replays them (see render_frame()).
+   Every command carries the pass it belongs to, for the GPU profiler.
+
+   Commands are drawn in the order of a 64-bit sort key rather than in the
+   order draw() records them: layer, then program, vertex array and fill
+   mode. Layers are drawn back to front and each one covers the ones before
+   it, so the depth test is off. Within a layer, commands using the same
+   state are drawn one after the other and equal keys keep the order they
+   were recorded in. */
+enum Pass {
+    PASS_MAINLINE, PASS_LASERS, PASS_CANNON, PASS_BUCKETS, PASS_BRICKS, PASS_MIRRORS, PASS_HUD, PASS_PARTICLES,
+    PASS_COUNT
+};
+const char* pass_names[PASS_COUNT] = {"mainline", "lasers", "cannon", "buckets", "bricks", "mirrors", "hud", "particles"};
+
+/* The order the game has always drawn in. The background cache holds the
+   mainline and the mirrors when it is on, see background_execute(). */
+enum Layer {
+    LAYER_BACKGROUND,           // the background cache
+    LAYER_MAINLINE,
+    LAYER_LASERS,
+    LAYER_CANNON,               // the cannon and the buckets
+    LAYER_BRICKS,
+    LAYER_PARTICLES,
+    LAYER_MIRRORS,
+    LAYER_HUD
+};
+
+enum RenderCommandType {
+    RENDER_BRICKS,              // brick instances First..First+Count of the frame
+    RENDER_STATIC_SCENE,        // the static scene, with the frame's matrices
+    RENDER_TEXT,                // glyphs First..First+Count of the frame
+    RENDER_LASERS,              // laser instances First..First+Count of the frame
+    RENDER_PARTICLES,           // the frame's Count particles
+    RENDER_BACKGROUND           // the background cache, with the frame's scene matrices
+};
+
+struct RenderCommand {
+    int Type;
+    int First, Count;
+    glm::mat4 VP;
+    int Pass;                   // -1 when the command times its own passes
+    GLuint64 Key;               // see render_key()
+};
+
+vector<RenderCommand> render_commands;  // the frame being recorded
+
+/* layer:8 | program:8 | vertex array:32 | fill mode:16 */
+GLuint64 render_key (int layer, const ShaderProgram& program, GLuint vertex_array, GLenum fill_mode)
+{
+    return (GLuint64) layer << 56 | (GLuint64) (program.Number & 0xff) << 48
+         | (GLuint64) vertex_array << 16 | (fill_mode & 0xffff);
+}
+
+void render_record (int type, int first, int count, glm::mat4 VP, int pass, GLuint64 key)
+{
+    RenderCommand cmd = {type, first, count, VP, pass, key};
+    render_commands.push_back(cmd);
+}
+
+struct RenderSort {
+    vector<GLuint64> keys, next_keys;
+    vector<int> order, next_order;
+    vector<RenderCommand> sorted;
+} render_sort_buffers;
+
+/* Stable LSD radix sort of the commands by key, a byte per round. Rounds
+   where every key has the same byte, most of them, are skipped. */
+void render_sort (vector<RenderCommand>& commands)
+{
+    RenderSort& rs = render_sort_buffers;
+    int n = commands.size();
+    if (n < 2)
+        return;
+    rs.keys.resize(n);
+    rs.next_keys.resize(n);
+    rs.order.resize(n);
+    rs.next_order.resize(n);
+    for (int i=0; i<n; i++) {
+        rs.keys[i] = commands[i].Key;
+        rs.order[i] = i;
+    }
+
+    for (int shift=0; shift<64; shift+=8) {
+        int start[257] = {0};
+        for (int i=0; i<n; i++)
+            start[((rs.keys[i] >> shift) & 0xff) + 1]++;
+        if (start[((rs.keys[0] >> shift) & 0xff) + 1] == n)
+            continue;
+        for (int b=0; b<256; b++)
+            start[b+1] += start[b];
+        for (int i=0; i<n; i++) {
+            int to = start[(rs.keys[i] >> shift) & 0xff]++;
+            rs.next_keys[to] = rs.keys[i];
+            rs.next_order[to] = rs.order[i];
+        }
+        rs.keys.swap(rs.next_keys);
+        rs.order.swap(rs.next_order);
+    }
+
+    rs.sorted.resize(n);
+    for (int i=0; i<n; i++)
+        rs.sorted[i] = commands[rs.order[i]];
+    commands.swap(rs.sorted);
+}
+
+/*****************
+ * Sprite batch  *
+ *****************/
+/* Sprites are transformed on the CPU and appended to one dynamic vertex
+   stream, which is then sent with one draw call per run of sprites sharing
+   a fill mode. Every object of the game now has a renderer of its own, the
+   profiler overlay is what is still drawn this way. Quads only upload their
+   4 compact vertices, indices come from quad_indices(). */
+struct BatchRun {           // consecutive sprites drawn the same way
+    GLenum FillMode;
+    int Indexed;            // 1 for quads, 0 for plain triangles
+    int First;
+    int NumVertices;
+    int Pass;
+};
+
+struct SpriteBatch {
+    GLuint VertexArrayID;   // reads the vertices from the stream buffer
+    int DrawCalls;          // draw calls issued for the frame being drawn
+} sprite_batch;
+
+void sprite_batch_init ()
+{
+    if (software.Enabled)
+        return;
+    glGenVertexArrays(1, &sprite_batch.VertexArrayID);
+    state_bind_vertex_array (sprite_batch.VertexArrayID);
+    glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, quad_indices());
+}
+
+/* Upload runs first..first+count of a frame and draw them */
+void sprite_batch_execute (const vector<CompactVertex>& vertices, const vector<BatchRun>& runs, int first, int count, glm::mat4 VP)
+{
+    if (software.Enabled) {
+        for (int r=first; r<first+count; r++) {
+            BatchRun run = runs[r];
+            sw_draw(&vertices[run.First], run.NumVertices, run.Indexed, VP * dequantize_matrix(), run.FillMode);
+            sprite_batch.DrawCalls++;
+        }
+        return;
+    }
+
+    // Only the vertices of these runs go up, drawn relative to the first of them
+    int base = runs[first].First;
+    int size = runs[first+count-1].First + runs[first+count-1].NumVertices - base;
+    GLintptr offset;
+    memcpy(stream_map(size*sizeof(CompactVertex), sizeof(CompactVertex), &offset), &vertices[base], size*sizeof(CompactVertex));
+    stream_unmap();
+    state_bind_vertex_array (sprite_batch.VertexArrayID);
+    state_bind_array_buffer (stream.Buffer);
+    compact_vertex_attributes(offset);
+
+    // Vertices are already in world space
+    program_use (main_program);
+    set_mvp(VP * dequantize_matrix());
+    for (int r=first; r<first+count; r++) {
+        BatchRun run = runs[r];
+        state_polygon_mode (run.FillMode);
+        if (!run.Indexed) {
+            glDrawArrays(GL_TRIANGLES, run.First - base, run.NumVertices);
+            sprite_batch.DrawCalls++;
+            continue;
+        }
+        for (int q=0; q<run.NumVertices/4; q+=MAX_QUADS_PER_DRAW) {
+            int quads = min(run.NumVertices/4 - q, MAX_QUADS_PER_DRAW);
+            glDrawElementsBaseVertex(GL_TRIANGLES, 6*quads, GL_UNSIGNED_SHORT, (void*)0, run.First - base + 4*q);
+            sprite_batch.DrawCalls++;
+        }
+    }
+}
+
+/* The instanced attributes of Sample_GL.vert fall back to these values when
+   their arrays are disabled, so non-instanced draws are left untouched. They
+   are undefined after an instanced draw and must be set again. */
+void reset_instance_attributes ()
+{
+    if (software.Enabled)
+        return;
+    glVertexAttrib4f(2, 0.0f, 0.0f, 1.0f, 1.0f); // instanceRect: no offset, unit scale
+    glVertexAttrib3f(3, 1.0f, 1.0f, 1.0f);       // instanceColor: white
+}
+
+/* Transform the triangles of an object to world space and append them to a vertex list */
+void sprite_batch_append (vector<CompactVertex>& vertices, vector<BatchRun>& runs, struct VAO* vao, glm::mat4 model, int pass)
+{
+    int indexed = vao->NumIndices ? 1 : 0;
+    int first = vertices.size();
+    if (runs.empty() || runs.back().FillMode != vao->FillMode || runs.back().Indexed != indexed
+        || runs.back().Pass != pass) {
+        BatchRun run = {vao->FillMode, indexed, first, 0, pass};
+        runs.push_back(run);
+    }
+    runs.back().NumVertices += vao->NumVertices;
+
+    vertices.resize(first + vao->NumVertices);
+    CompactVertex* out = &vertices[first];
+    for (int v=0; v<vao->NumVertices; v++) {
+        const CompactVertex& in = vao->Vertices[v];
+        glm::vec4 w = model * glm::vec4(in.x/POSITION_SCALE, in.y/POSITION_SCALE, 0.0f, 1.0f);
+        out[v] = in;
+        out[v].x = quantize_position(w.x);
+        out[v].y = quantize_position(w.y);
+    }
+}
+
+/**************************
+ * Customizable functions *
+ **************************/
+float x_change = 0; //For the camera pan
+float y_change = 0; //For the camera pan
+float zoom_camera = 1;
+float brick_speed=-2,brick_dy=-0.5;
+int num_bricks=100;
+float degree_per_rotation=1,partition=-190,lazer_speed=20,bucket_speed=10;
+double mouse_pos_x=0, mouse_pos_y=0;
+double new_mouse_pos_x=0, new_mouse_pos_y=0;
+double time_diff=0, current_time,old_time,laz_time,laz_old_time,m_col_time;
+COLOR col[3]={black,red,green};
+long long score=0,laz_no=0,mleft_click=0,mright_click=0,kleft_click=0,kright_click=0,ctrl=0,alt=0,mis_hit=6;
+
+void create_lazer(int no);
+void input_event ();
+/* Executed when a regular key is pressed/released/held-down */
+void mousescroll(GLFWwindow* window, double xoffset, double yoffset)
+{
+    input_event();
+    if (yoffset==-1) {
+        zoom_camera /= 1.1; //make it bigger than current size
+    }
+    else if(yoffset==1){
+        zoom_camera *= 1.1; //make it bigger than current size
+    }
+    if (zoom_camera<=1) {
+        zoom_camera = 1;
+    }
+    if (zoom_camera>=4) {
+        zoom_camera=4;
+    }
+    if(x_change-500.0f/zoom_camera<-500)
+        x_change=-500+500.0f/zoom_camera;
+    else if(x_change+500.0f/zoom_camera>500)
+        x_change=500-500.0f/zoom_camera;
+    if(y_change-350.0f/zoom_camera<-350)
+        y_change=-350+350.0f/zoom_camera;
+    else if(y_change+350.0f/zoom_camera>350)
+        y_change=350-350.0f/zoom_camera;
+    Matrices.projection = glm::ortho((float)(-500.0f/zoom_camera+x_change), (float)(500.0f/zoom_camera+x_change), (float)(-350.0f/zoom_camera+y_change), (float)(350.0f/zoom_camera+y_change), 0.1f, 500.0f);
+}
+
+//Ensure the panning does not go out of the map
+void check_pan(){
+    if(x_change-500.0f/zoom_camera<-500)
+        x_change=-500+500.0f/zoom_camera;
+    else if(x_change+500.0f/zoom_camera>500)
+        x_change=500-500.0f/zoom_camera;
+    if(y_change-350.0f/zoom_camera<-350)
+        y_change=-350+350.0f/zoom_camera;
+    else if(y_change+350.0f/zoom_camera>350)
+        y_change=350-350.0f/zoom_camera;
+}
+
+/* Prefered for Keyboard events */
+void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+    input_event();
+    //for detecting multiple key press
+    glfwSetInputMode(window, GLFW_STICKY_KEYS, 1);
+     // Function is called first on GLFW_PRESS.
+
+    if (action == GLFW_RELEASE) {
+        switch (key) {
+            case GLFW_KEY_UP:
+                mousescroll(window,0,+1);
+                check_pan();
+                break;
+            case GLFW_KEY_DOWN:
+                mousescroll(window,0,-1);
+                check_pan();
+                break;
+            case GLFW_KEY_RIGHT:
+                kright_click=0;
+                x_change+=10;
+                check_pan();
+                break;
+            case GLFW_KEY_LEFT:
+                kleft_click=0;
+                x_change-=10;
+                check_pan();
+                break;
+            case GLFW_KEY_V:
+                y_change+=10;
+                check_pan();
+                break;
+            case GLFW_KEY_B:
+                y_change-=10;
+                check_pan();
+                break;
+            case GLFW_KEY_S:
+                cannon["main"].dy=0;
+                cannon["front"].dy=0;
+                cannon["main"].key_press=0;
+                cannon["front"].key_press=0;
+                break;
+            case GLFW_KEY_F:
+                cannon["main"].dy=0;
+                cannon["front"].dy=0;
+                cannon["main"].key_press=0;
+                cannon["front"].key_press=0;
+                break;
+            case GLFW_KEY_A:
+                cannon["front"].key_press=0;
+                break;
+            case GLFW_KEY_D:
+                cannon["front"].key_press=0;
+                break;
+            case GLFW_KEY_N:
+                if(brick_speed-brick_dy>-8)
+                  brick_speed+=brick_dy;
+                break;
+            case GLFW_KEY_M:
+                if(brick_speed-brick_dy<-2)
+                  brick_speed-=brick_dy;
+                break;
+            case GLFW_KEY_SPACE:
+                if(current_time-laz_old_time>1)
+                {
+                  create_lazer(laz_no/2);
+                  laz_no++;
+                  laz_old_time=current_time;
+                }
+                break;
+            case GLFW_KEY_LEFT_CONTROL:
+                ctrl=0;
                 break;
             case GLFW_KEY_RIGHT_CONTROL:
                 ctrl=0;
@@ -398,329 +1978,2362 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
                 break;
         }
     }
-    else if (action == GLFW_PRESS) {
-        switch (key) {
-          case GLFW_KEY_S:
-              cannon["main"].dy=3;
-              cannon["front"].dy=3;
-              cannon["main"].key_press=1;
-              break;
-          case GLFW_KEY_F:
-              cannon["main"].dy=-3;
-              cannon["front"].dy=-3;
-              cannon["main"].key_press=1;
-              break;
-          case GLFW_KEY_A:
-              cannon["front"].key_press=1;
-              break;
-          case GLFW_KEY_D:
-              cannon["front"].key_press=2;
-              break;
-          case GLFW_KEY_LEFT_CONTROL:
-              ctrl=1;
-              break;
-          case GLFW_KEY_RIGHT_CONTROL:
-              ctrl=1;
-              break;
-          case GLFW_KEY_LEFT_ALT:
-              alt=1;
-              break;
-          case GLFW_KEY_RIGHT_ALT:
-              alt=1;
-              break;
-          case GLFW_KEY_RIGHT:
-              kright_click=1;
-              break;
-          case GLFW_KEY_LEFT:
-              kleft_click=1;
-              break;
-          case GLFW_KEY_ESCAPE:
-              quit(window);
-              break;
-          default:
-                break;
+    else if (action == GLFW_PRESS) {
+        switch (key) {
+          case GLFW_KEY_S:
+              cannon["main"].dy=3;
+              cannon["front"].dy=3;
+              cannon["main"].key_press=1;
+              break;
+          case GLFW_KEY_F:
+              cannon["main"].dy=-3;
+              cannon["front"].dy=-3;
+              cannon["main"].key_press=1;
+              break;
+          case GLFW_KEY_A:
+              cannon["front"].key_press=1;
+              break;
+          case GLFW_KEY_D:
+              cannon["front"].key_press=2;
+              break;
+          case GLFW_KEY_LEFT_CONTROL:
+              ctrl=1;
+              break;
+          case GLFW_KEY_RIGHT_CONTROL:
+              ctrl=1;
+              break;
+          case GLFW_KEY_LEFT_ALT:
+              alt=1;
+              break;
+          case GLFW_KEY_RIGHT_ALT:
+              alt=1;
+              break;
+          case GLFW_KEY_RIGHT:
+              kright_click=1;
+              break;
+          case GLFW_KEY_LEFT:
+              kleft_click=1;
+              break;
+          case GLFW_KEY_ESCAPE:
+              quit(window);
+              break;
+          default:
+                break;
+        }
+    }
+    if(ctrl && kleft_click)
+    {
+      bucket["red"].dx=-1*bucket_speed;
+      bucket["red"].key_press=1;
+    }
+    else if(ctrl && kright_click)
+    {
+      bucket["red"].dx=bucket_speed;
+      bucket["red"].key_press=1;
+    }
+    else
+    {
+      bucket["red"].dx=0;
+      bucket["red"].key_press=0;
+    }
+
+    if(alt && kleft_click)
+    {
+      bucket["green"].dx=-1*bucket_speed;
+      bucket["green"].key_press=1;
+    }
+     else if(alt && kright_click)
+    {
+      bucket["green"].dx=bucket_speed;
+      bucket["green"].key_press=1;
+    }
+    else
+    {
+      bucket["green"].dx=0;
+      bucket["green"].key_press=0;
+    }
+}
+
+/* Executed for character input (like in text boxes) */
+void keyboardChar (GLFWwindow* window, unsigned int key)
+{
+	switch (key) {
+		case 'Q':
+		case 'q':
+            quit(window);
+            break;
+		default:
+			break;
+	}
+}
+
+string move;
+/* Executed when a mouse button is pressed/released */
+void mouseButton (GLFWwindow* window, int button, int action, int mods)
+{
+  input_event();
+  Sprite b1=bucket["red"],b2=bucket["green"],c1=cannon["main"],c2=cannon["front"];
+    switch (button) {
+        case GLFW_MOUSE_BUTTON_LEFT:
+            if (action == GLFW_PRESS)
+            {
+              mleft_click=1;
+              glfwGetCursorPos(window, &new_mouse_pos_x, &new_mouse_pos_y);
+              new_mouse_pos_x=new_mouse_pos_x-500;
+              new_mouse_pos_y=new_mouse_pos_y*-1+350;
+              if(abs(new_mouse_pos_x-b1.x)<b1.width/2 && abs(new_mouse_pos_y-b1.y)<b1.height/2)
+                move="red";
+              else if(abs(new_mouse_pos_x-b2.x)<b2.width/2 && abs(new_mouse_pos_y-b2.y)<b2.height/2)
+                move="green";
+              else if(abs(new_mouse_pos_x-c1.x)<c1.width/2 && abs(new_mouse_pos_y-c1.y)<c1.height/2)
+                move="cmain";
+              else
+                move="dont";
+            }
+            if (action == GLFW_RELEASE)
+            {
+              mleft_click=0;
+              float cur_angle;
+              glfwGetCursorPos(window, &new_mouse_pos_x, &new_mouse_pos_y);
+              new_mouse_pos_x=new_mouse_pos_x-500;
+              new_mouse_pos_y=new_mouse_pos_y*-1+350;
+              cur_angle=atan((new_mouse_pos_y-c2.y)/(new_mouse_pos_x-c2.x))*180/M_PI;
+              if(new_mouse_pos_x>(c2.x) && new_mouse_pos_y>partition)
+              {
+                // cout<<"hello"<<cur_angle;
+                if(current_time-laz_old_time>1)
+                {
+                  cannon["front"].rot_angle=cur_angle;
+                  create_lazer(laz_no/2);
+                  laz_no++;
+                  laz_old_time=current_time;
+                }
+              }
+            }
+            break;
+        case GLFW_MOUSE_BUTTON_RIGHT:
+            if (action == GLFW_PRESS) {
+                mright_click=1;
+            }
+            if (action == GLFW_RELEASE)
+            {
+              mright_click=0;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+
+/* Executed when window is resized to 'width' and 'height' */
+/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
+void reshapeWindow (GLFWwindow* window, int width, int height)
+{
+    int fbwidth=width, fbheight=height;
+    /* With Retina display on Mac OS X, GLFW's FramebufferSize
+     is different from WindowSize */
+    if (window) {
+        glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+    }
+
+	GLfloat fov = 90.0f;
+
+	// The render thread sets the viewport up for it with the next frame
+	resolution.Width = fbwidth;
+	resolution.Height = fbheight;
+
+	// set the projection matrix as perspective
+	/* glMatrixMode (GL_PROJECTION);
+	   glLoadIdentity ();
+	   gluPerspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1, 500.0); */
+	// Store the projection matrix in a variable for future use
+    // Perspective projection for 3D views
+    // Matrices.projection = glm::perspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1f, 500.0f);
+
+    // Ortho projection for 2D views (-x,+x,-y,+y)
+      Matrices.projection = glm::ortho((float)(-500.0f/zoom_camera+x_change), (float)(500.0f/zoom_camera+x_change), (float)(-350.0f/zoom_camera+y_change), (float)(350.0f/zoom_camera+y_change), 0.1f, 500.0f);
+  //  Matrices.projection = glm::ortho(-500.0f/zoom_camera, 500.0f/zoom_camera, -350.0f/zoom_camera, 350.0f/zoom_camera, 0.1f, 500.0f);
+}
+
+
+/*******************
+ * Geometry cache  *
+ *******************/
+/* Shapes never change once uploaded, so every sprite asking for the same
+   (shape, colour, width, height) shares one VAO. GPU object count then stays
+   constant over a session no matter how many lasers are fired. */
+enum Shape { SHAPE_RECTANGLE };
+
+struct GeometryKey {
+    int shape;
+    float r, g, b;
+    float width, height;
+};
+
+bool operator< (const GeometryKey& a, const GeometryKey& b)
+{
+    if (a.shape != b.shape) return a.shape < b.shape;
+    if (a.r != b.r) return a.r < b.r;
+    if (a.g != b.g) return a.g < b.g;
+    if (a.b != b.b) return a.b < b.b;
+    if (a.width != b.width) return a.width < b.width;
+    return a.height < b.height;
+}
+
+map <GeometryKey, VAO*> geometry_cache;
+long long geometry_cache_hits=0;
+
+/* Returns the shared VAO for key, or NULL if it has not been built yet */
+VAO* find_geometry (GeometryKey key)
+{
+    map<GeometryKey, VAO*>::iterator it = geometry_cache.find(key);
+    if (it == geometry_cache.end())
+        return NULL;
+    geometry_cache_hits++;
+    return it->second;
+}
+
+VAO* store_geometry (GeometryKey key, VAO* vao)
+{
+    geometry_cache[key] = vao;
+    return vao;
+}
+
+VAO* createLine (COLOR color,int x1,int y1,int x2,int y2)
+{
+  /* ONLY vertices between the bounds specified in glm::ortho will be visible on screen */
+
+  /* Define vertex array as used in glBegin (GL_TRIANGLES) */
+   GLfloat vertex_buffer_data [] = {
+    x1, y2,0, // vertex 0
+    (x1+x2)/2,(y1+y2)/2,0, // vertex 1
+    x2,y2,0, // vertex 2
+  };
+
+   GLfloat color_buffer_data [] = {
+    color.r,color.g,color.b, // color 0
+    color.r,color.g,color.b, // color 1
+    color.r,color.g,color.b, // color 2
+  };
+
+  // create3DObject creates and returns a handle to a VAO that can be used later
+  return create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
+}
+
+
+// Creates the triangle object used in this sample code
+VAO* createTriangle ()
+{
+  /* ONLY vertices between the bounds specified in glm::ortho will be visible on screen */
+
+  /* Define vertex array as used in glBegin (GL_TRIANGLES) */
+  GLfloat vertex_buffer_data [] = {
+    0, 0,0, // vertex 0
+    4.0,4.0,0, // vertex 1
+    -4,-4,0, // vertex 2
+  };
+
+  GLfloat color_buffer_data [] = {
+    1,0,0, // color 0
+    0,1,0, // color 1
+    0,0,1, // color 2
+  };
+
+  // create3DObject creates and returns a handle to a VAO that can be used later
+  return create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
+}
+
+
+// Creates the rectangle object used in this sample code
+// Rectangles are shared through the geometry cache, never modify the result
+VAO* createRectangle (COLOR color1, float height, float width)
+{
+  GeometryKey key = {SHAPE_RECTANGLE, color1.r, color1.g, color1.b, width, height};
+  VAO* cached = find_geometry(key);
+  if (cached)
+    return cached;
+
+  // GL3 accepts only Triangles. Quads are indexed as (1,2,3) (3,4,1)
+  float w=width/2,h=height/2;
+  GLfloat vertex_buffer_data [] = {
+      -w,-h,0, // vertex 1
+      -w,h,0, // vertex 2
+      w,h,0, // vertex 3
+      w,-h,0, // vertex 4
+  };
+
+   GLfloat color_buffer_data [] = {
+    color1.r,color1.g,color1.b, // color 1
+    color1.r,color1.g,color1.b, // color 2
+    color1.r,color1.g,color1.b, // color 3
+    color1.r,color1.g,color1.b, // color 4
+  };
+
+  // createQuadObject creates and returns a handle to a VAO that can be used later
+
+    return store_geometry(key, createQuadObject(1, vertex_buffer_data, color_buffer_data, GL_FILL));
+}
+
+/****************
+ * GPU profiler *
+ ****************/
+/* --profile FILE brackets each pass of render_frame() with GL_TIMESTAMP
+   queries. Queries of a frame are read PROFILER_LATENCY frames later, and
+   only once they are available, so nothing waits on the GPU. Per pass GPU
+   times go to a CSV log with the simulation and render thread CPU times of
+   the same frame, and to a stacked graph drawn over the game (the black
+   ticks are the simulation time). */
+COLOR pass_colors[PASS_COUNT] = {
+    {0.3f, 0.3f, 0.3f}, {0.0f, 0.67f, 1.0f}, {0.0f, 0.0f, 1.0f}, {1.0f, 0.2f, 0.2f},
+    {1.0f, 0.6f, 0.0f}, {0.2f, 0.8f, 0.8f}, {0.8f, 0.2f, 0.8f}, {1.0f, 0.85f, 0.0f}
+};
+
+#define PROFILER_LATENCY 4      // frames in flight before results are read
+#define PROFILER_HISTORY 120    // frames shown on the graph
+
+struct ProfilerFrame {
+    vector<GLuint> queries;     // begin/end timestamp pairs, frame begin/end first
+    vector<int> passes;         // pass of each pair after the first
+    int Used;                   // timestamp queries issued this frame
+    int Pending;                // results not read yet
+    long Number;
+    double CPUTime;             // simulation, recording the frame
+    double RenderTime;          // render thread, replaying it
+};
+
+struct Profiler {
+    int Enabled;
+    string Path;
+    FILE* Log;
+    ProfilerFrame frames[PROFILER_LATENCY];
+    long Frame;
+    double CPUStart;
+    long Dropped;               // frames whose results were not ready in time
+    VAO* Bars[PASS_COUNT];      // overlay geometry, made up front as the
+    VAO* Axis;                  // render thread can not use the geometry cache
+    VAO* Tick;
+
+    // Graph history, oldest first once full
+    float pass_ms[PROFILER_HISTORY][PASS_COUNT];
+    float cpu_ms[PROFILER_HISTORY];
+    int HistoryNext, HistoryCount;
+    float LastGPU, LastCPU;
+} profiler;
+
+GLuint profiler_query ()
+{
+    ProfilerFrame& f = profiler.frames[profiler.Frame % PROFILER_LATENCY];
+    if (f.Used == (int) f.queries.size()) {
+        GLuint query;
+        glGenQueries(1, &query);
+        f.queries.push_back(query);
+    }
+    return f.queries[f.Used++];
+}
+
+void profile_begin (int pass)
+{
+    if (!profiler.Enabled)
+        return;
+    profiler.frames[profiler.Frame % PROFILER_LATENCY].passes.push_back(pass);
+    glQueryCounter(profiler_query(), GL_TIMESTAMP);
+}
+
+void profile_end ()
+{
+    if (!profiler.Enabled)
+        return;
+    glQueryCounter(profiler_query(), GL_TIMESTAMP);
+}
+
+void profiler_init ()
+{
+    if (software.Enabled) {
+        fprintf(stderr, "Warning: --profile needs OpenGL, ignored with --software\n");
+        profiler.Enabled = 0;
+        return;
+    }
+    profiler.Log = fopen(profiler.Path.c_str(), "w");
+    if (!profiler.Log) {
+        fprintf(stderr, "Error: could not write %s\n", profiler.Path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    for (int p=0; p<PASS_COUNT; p++)
+        profiler.Bars[p] = createRectangle(pass_colors[p], 1, 1);
+    profiler.Axis = createRectangle(grey, 1, 1);
+    profiler.Tick = createRectangle(black, 1, 1);
+
+    fprintf(profiler.Log, "frame,cpu_ms,render_ms,gpu_ms");
+    for (int p=0; p<PASS_COUNT; p++)
+        fprintf(profiler.Log, ",%s_ms", pass_names[p]);
+    fprintf(profiler.Log, "\n");
+}
+
+/* Read a finished frame into the log and the graph, if the GPU is done with it */
+void profiler_collect (ProfilerFrame& f)
+{
+    GLint available = 0;
+    glGetQueryObjectiv(f.queries[f.Used - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+    f.Pending = 0;
+    if (!available) {
+        profiler.Dropped++;
+        return;
+    }
+
+    vector<GLuint64> stamps(f.Used);
+    for (int q=0; q<f.Used; q++)
+        glGetQueryObjectui64v(f.queries[q], GL_QUERY_RESULT, &stamps[q]);
+
+    float* pass_ms = profiler.pass_ms[profiler.HistoryNext];
+    for (int p=0; p<PASS_COUNT; p++)
+        pass_ms[p] = 0;
+    for (size_t i=0; i<f.passes.size(); i++)
+        pass_ms[f.passes[i]] += (stamps[2 + 2*i + 1] - stamps[2 + 2*i]) * 1e-6f;
+    float gpu_ms = (stamps[1] - stamps[0]) * 1e-6f;
+    float cpu_ms = f.CPUTime * 1e3f;
+
+    fprintf(profiler.Log, "%ld,%.4f,%.4f,%.4f", f.Number, cpu_ms, f.RenderTime * 1e3f, gpu_ms);
+    for (int p=0; p<PASS_COUNT; p++)
+        fprintf(profiler.Log, ",%.4f", pass_ms[p]);
+    fprintf(profiler.Log, "\n");
+
+    profiler.cpu_ms[profiler.HistoryNext] = cpu_ms;
+    profiler.HistoryNext = (profiler.HistoryNext + 1) % PROFILER_HISTORY;
+    profiler.HistoryCount = min(profiler.HistoryCount + 1, PROFILER_HISTORY);
+    profiler.LastGPU = gpu_ms;
+    profiler.LastCPU = cpu_ms;
+}
+
+void profiler_begin_frame ()
+{
+    if (!profiler.Enabled)
+        return;
+    // This slot was last used PROFILER_LATENCY frames ago
+    ProfilerFrame& f = profiler.frames[profiler.Frame % PROFILER_LATENCY];
+    if (f.Pending)
+        profiler_collect(f);
+    f.Used = 0;
+    f.passes.clear();
+    f.Number = profiler.Frame;
+    profiler.CPUStart = game_time();
+
+    // Two queries for the whole frame come first, the end one is filled in later
+    glQueryCounter(profiler_query(), GL_TIMESTAMP);
+    profiler_query();
+}
+
+void profiler_end_frame (double cpu_time)
+{
+    if (!profiler.Enabled)
+        return;
+    ProfilerFrame& f = profiler.frames[profiler.Frame % PROFILER_LATENCY];
+    glQueryCounter(f.queries[1], GL_TIMESTAMP);
+    f.CPUTime = cpu_time;
+    f.RenderTime = game_time() - profiler.CPUStart;
+    f.Pending = 1;
+    profiler.Frame++;
+}
+
+/* Stacked per pass GPU times of the last frames, in the top left corner */
+void profiler_draw_overlay ()
+{
+    if (!profiler.Enabled || profiler.HistoryCount == 0)
+        return;
+
+    // Fixed screen space, whatever the zoom and pan are
+    glm::mat4 VP = glm::ortho(-500.0f, 500.0f, -350.0f, 350.0f, 0.1f, 500.0f) *
+                   glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0));
+    program_use (main_program);
+    vector<CompactVertex> vertices;
+    vector<BatchRun> runs;
+
+    // The graph is 100 units high and scales to the slowest frame shown, 1 ms at least
+    float top = 1;
+    for (int i=0; i<profiler.HistoryCount; i++) {
+        float gpu = 0;
+        for (int p=0; p<PASS_COUNT; p++)
+            gpu += profiler.pass_ms[i][p];
+        top = max(top, max(gpu, profiler.cpu_ms[i]));
+    }
+    float scale = 100/top, left = -490, bottom = 230, column = 3;
+
+    sprite_batch_append(vertices, runs, profiler.Axis,
+                        glm::translate(glm::vec3(left + column*PROFILER_HISTORY/2, bottom - 1, 0)) *
+                        glm::scale(glm::vec3(column*PROFILER_HISTORY, 2, 1)), -1);
+
+    int oldest = profiler.HistoryCount < PROFILER_HISTORY ? 0 : profiler.HistoryNext;
+    for (int c=0; c<profiler.HistoryCount; c++) {
+        int i = (oldest + c) % PROFILER_HISTORY;
+        float x = left + column*(c + 0.5f), y = bottom;
+        for (int p=0; p<PASS_COUNT; p++) {
+            float h = profiler.pass_ms[i][p]*scale;
+            if (h <= 0)
+                continue;
+            sprite_batch_append(vertices, runs, profiler.Bars[p],
+                                glm::translate(glm::vec3(x, y + h/2, 0)) * glm::scale(glm::vec3(column, h, 1)), -1);
+            y += h;
+        }
+        sprite_batch_append(vertices, runs, profiler.Tick,
+                            glm::translate(glm::vec3(x, bottom + profiler.cpu_ms[i]*scale, 0)) *
+                            glm::scale(glm::vec3(column, 1, 1)), -1);
+    }
+    sprite_batch_execute(vertices, runs, 0, runs.size(), VP);
+}
+
+/* Read what is still in flight and close the log */
+void profiler_finish ()
+{
+    if (!profiler.Enabled)
+        return;
+    glFinish();
+    for (long f=max(0L, profiler.Frame - PROFILER_LATENCY); f<profiler.Frame; f++)
+        if (profiler.frames[f % PROFILER_LATENCY].Pending)
+            profiler_collect(profiler.frames[f % PROFILER_LATENCY]);
+    fclose(profiler.Log);
+    printf("Profile: %ld frames logged to %s, %ld dropped as not ready in time\n",
+           profiler.Frame - profiler.Dropped, profiler.Path.c_str(), profiler.Dropped);
+}
+
+/*********************
+ * Instanced bricks  *
+ *********************/
+/* Every brick is the same quad in one of three colours, so all of them are
+   drawn from one unit quad with a per-instance position, size and colour. */
+struct BrickInstance {
+    GLfloat x, y, width, height;
+    GLfloat r, g, b;
+};
+
+struct BrickRenderer {
+    GLuint VertexArrayID;
+    GLuint QuadBuffer;          // unit quad shared by every brick
+    vector<BrickInstance> instances;
+    int Recorded;               // instances already covered by a render command
+} brick_renderer;
+
+void brick_renderer_init ()
+{
+    if (software.Enabled)
+        return;
+
+    // Unit quad with float positions, so the instance size scales it exactly
+    struct { GLfloat x, y; GLubyte r, g, b, a; } quad [] = {
+        {-0.5f,-0.5f, 255,255,255,255},
+        {-0.5f, 0.5f, 255,255,255,255},
+        { 0.5f, 0.5f, 255,255,255,255},
+        { 0.5f,-0.5f, 255,255,255,255}
+    };
+
+    glGenVertexArrays(1, &brick_renderer.VertexArrayID);
+    glGenBuffers(1, &brick_renderer.QuadBuffer);
+
+    state_bind_vertex_array (brick_renderer.VertexArrayID);
+    state_bind_array_buffer (brick_renderer.QuadBuffer);
+    glBufferData (GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(quad[0]), (void*)0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(quad[0]), (void*)(2*sizeof(GLfloat)));
+    glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, quad_indices());
+
+    // The instances come from the stream buffer, see brick_renderer_execute()
+    glEnableVertexAttribArray(2);
+    glVertexAttribDivisor(2, 1);
+    glEnableVertexAttribArray(3);
+    glVertexAttribDivisor(3, 1);
+}
+
+void brick_renderer_add (Sprite obj)
+{
+    if (!cull_visible(glm::mat4(1.0f), obj.x - obj.width/2, obj.y - obj.height/2, obj.x + obj.width/2, obj.y + obj.height/2))
+        return;
+    BrickInstance inst = {obj.x, obj.y, obj.width, obj.height, obj.color.r, obj.color.g, obj.color.b};
+    brick_renderer.instances.push_back(inst);
+}
+
+/* Record every brick queued since the last call */
+void brick_renderer_draw (glm::mat4 VP)
+{
+    int count = brick_renderer.instances.size() - brick_renderer.Recorded;
+    if (count == 0)
+        return;
+    render_record(RENDER_BRICKS, brick_renderer.Recorded, count, VP, PASS_BRICKS,
+                  render_key(LAYER_BRICKS, main_program, brick_renderer.VertexArrayID, GL_FILL));
+    brick_renderer.Recorded += count;
+}
+
+/* Draw bricks with a single instanced call */
+void brick_renderer_execute (const BrickInstance* instances, int count, glm::mat4 VP)
+{
+    if (software.Enabled) {
+        for (int i=0; i<count; i++) {
+            BrickInstance b = instances[i];
+            GLubyte r = quantize_color(b.r), g = quantize_color(b.g), bl = quantize_color(b.b);
+            GLshort x0 = quantize_position(b.x - b.width/2), x1 = quantize_position(b.x + b.width/2);
+            GLshort y0 = quantize_position(b.y - b.height/2), y1 = quantize_position(b.y + b.height/2);
+            CompactVertex quad[4] = {{x0,y0, r,g,bl,255}, {x0,y1, r,g,bl,255}, {x1,y1, r,g,bl,255}, {x1,y0, r,g,bl,255}};
+            sw_draw(quad, 4, 1, VP * dequantize_matrix(), GL_FILL);
+        }
+        return;
+    }
+
+    GLintptr offset;
+    memcpy(stream_map(count*sizeof(BrickInstance), sizeof(BrickInstance), &offset), instances, count*sizeof(BrickInstance));
+    stream_unmap();
+    state_bind_vertex_array (brick_renderer.VertexArrayID);
+    state_bind_array_buffer (stream.Buffer);
+    glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(BrickInstance), (void*)offset);
+    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(BrickInstance), (void*)(offset + 4*sizeof(GLfloat)));
+
+    program_use (main_program);
+    set_mvp(VP);
+    state_polygon_mode (GL_FILL);
+    glDrawElementsInstanced(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, (void*)0, count);
+    reset_instance_attributes();
+}
+
+float camera_rotation_angle = 90;
+float rectangle_rotation = 0;
+float triangle_rotation = 0;
+void reset_brick(int i)
+{
+  brick[i].status=0;
+  brick[i].y=350+brick[i].height/2;
+  brick[i].dx=0;
+  brick[i].dy=0;
+}
+void create_bricks(COLOR color1,int no,float x_co)
+{
+  brick[no].color=color1;
+  brick[no].width=25;
+  brick[no].height=50;
+  brick[no].object = NULL; // drawn by brick_renderer, no geometry of its own
+  brick[no].x=x_co;//-380
+  brick[no].y=350+brick[no].height/2;
+  brick[no].dx=0;
+  brick[no].dy=0;
+  brick[no].status=0;
+}
+
+/* Model matrix of a sprite: its position, and rotation for the ones that turn */
+glm::mat4 sprite_model(Sprite obj)
+{
+  Matrices.model = glm::mat4(1.0f);
+  //MVP = VP * Matrices.model; // MVP = p * V * M
+  glm::mat4 ObjectTransform;
+  glm::mat4 translateObject = glm::translate (glm::vec3(obj.x,obj.y, 0.0f)); // glTranslatef
+  glm::mat4  rotateTriangle=glm::mat4(1.0f);
+  if(obj.name=="mirror1" || obj.name=="mirror2" || obj.name=="mirror3" || obj.name=="mirror4")
+  {
+   rotateTriangle = glm::rotate((float)(obj.rot_angle*M_PI/180.0f), glm::vec3(0,0,1));  // rotate about vector (1,0,0)
+  }
+  if(obj.name=="gun")
+  {
+    rotateTriangle = glm::rotate((float)(cannon["front"].rot_angle*M_PI/180.0f), glm::vec3(0,0,1));
+  }
+  ObjectTransform=translateObject *rotateTriangle;
+  if(obj.name=="lazer")
+  {
+    translateObject = glm::translate (glm::vec3(obj.x,obj.y, 0.0f)); // glTranslatef
+    rotateTriangle = glm::rotate((float)(obj.rot_angle*M_PI/180.0f), glm::vec3(0,0,1));
+    ObjectTransform=translateObject * rotateTriangle;
+  }
+
+  Matrices.model *= ObjectTransform;
+  return Matrices.model;
+}
+
+/*****************
+ * Laser beams   *
+ *****************/
+/* A laser is only its centre, angle, length, width and colour. They all go
+   to a texture buffer, and Sample_GL_laser.vert builds each beam's quad from
+   gl_InstanceID and gl_VertexID, so any number of them take one small upload
+   and one draw call. */
+struct LaserInstance {
+    GLfloat x, y, angle, length;    // angle in radians
+    GLfloat width, r, g, b;
+};
+
+struct LaserRenderer {
+    ShaderProgram Program;
+    GLuint VPID;
+    GLuint FirstID;             // "first" uniform, texel of the first instance
+    GLuint VertexArrayID;       // no attributes, but core profile draws need one
+    GLuint InstanceTexture;     // the stream buffer as RGBA32F texels
+    int Generation;             // of the stream buffer it shows
+    vector<LaserInstance> instances;
+    int Recorded;               // instances already covered by a render command
+} laser_renderer;
+
+void laser_linked (GLuint program)
+{
+    laser_renderer.VPID = glGetUniformLocation(program, "VP");
+    laser_renderer.FirstID = glGetUniformLocation(program, "first");
+    state_use_program(program);
+    glUniform1i(glGetUniformLocation(program, "lasers"), 2);
+}
+
+void laser_init ()
+{
+    if (software.Enabled)
+        return;
+    program_start(laser_renderer.Program, "Sample_GL_laser.vert", "Sample_GL.frag", laser_linked);
+
+    // Texture unit 2 keeps the instances, 0 and 1 belong to the static scene and the text
+    glGenVertexArrays(1, &laser_renderer.VertexArrayID);
+    glGenTextures(1, &laser_renderer.InstanceTexture);
+    glActiveTexture (GL_TEXTURE2);
+    glBindTexture (GL_TEXTURE_BUFFER, laser_renderer.InstanceTexture);
+    glActiveTexture (GL_TEXTURE0);
+}
+
+void laser_add (Sprite obj)
+{
+    // The beam runs along its width, as made by create_lazer()
+    if (!cull_visible(sprite_model(obj), -obj.width/2, -obj.height/2, obj.width/2, obj.height/2))
+        return;
+    LaserInstance inst = {obj.x, obj.y, (GLfloat)(obj.rot_angle*M_PI/180.0f), obj.width,
+                          obj.height, obj.color.r, obj.color.g, obj.color.b};
+    laser_renderer.instances.push_back(inst);
+}
+
+/* Record every laser queued since the last call */
+void laser_draw (glm::mat4 VP)
+{
+    int count = laser_renderer.instances.size() - laser_renderer.Recorded;
+    if (count == 0)
+        return;
+    render_record(RENDER_LASERS, laser_renderer.Recorded, count, VP, PASS_LASERS,
+                  render_key(LAYER_LASERS, laser_renderer.Program, laser_renderer.VertexArrayID, GL_FILL));
+    laser_renderer.Recorded += count;
+}
+
+/* Draw lasers with a single instanced call */
+void laser_execute (const LaserInstance* instances, int count, glm::mat4 VP)
+{
+    if (software.Enabled) {
+        vector<CompactVertex> quads;
+        for (int i=0; i<count; i++) {
+            LaserInstance l = instances[i];
+            GLubyte r = quantize_color(l.r), g = quantize_color(l.g), b = quantize_color(l.b);
+            float c = cos(l.angle), s = sin(l.angle);
+            float corners[4][2] = {{-1,-1}, {-1,1}, {1,1}, {1,-1}};
+            for (int v=0; v<4; v++) {
+                float lx = corners[v][0]*l.length/2, ly = corners[v][1]*l.width/2;
+                CompactVertex vertex = {quantize_position(l.x + c*lx - s*ly), quantize_position(l.y + s*lx + c*ly), r, g, b, 255};
+                quads.push_back(vertex);
+            }
+        }
+        sw_draw(&quads[0], quads.size(), 1, VP * dequantize_matrix(), GL_FILL);
+        sprite_batch.DrawCalls++;
+        return;
+    }
+
+    GLintptr offset;
+    memcpy(stream_map(count*sizeof(LaserInstance), sizeof(LaserInstance), &offset), instances, count*sizeof(LaserInstance));
+    stream_unmap();
+    if (laser_renderer.Generation != stream.Generation) {
+        glActiveTexture (GL_TEXTURE2);
+        glTexBuffer (GL_TEXTURE_BUFFER, GL_RGBA32F, stream.Buffer);
+        glActiveTexture (GL_TEXTURE0);
+        laser_renderer.Generation = stream.Generation;
+    }
+
+    state_bind_vertex_array (laser_renderer.VertexArrayID);
+    program_use (laser_renderer.Program);
+    glUniformMatrix4fv(laser_renderer.VPID, 1, GL_FALSE, &VP[0][0]);
+    glUniform1i(laser_renderer.FirstID, offset / (4*sizeof(GLfloat)));
+    state_polygon_mode (GL_FILL);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+    sprite_batch.DrawCalls++;
+}
+
+/*****************
+ * Particles     *
+ *****************/
+/* A brick that is hit bursts into PARTICLE_BURST particles. They are kept
+   as structure of arrays, one array per field, so the update runs 4
+   particles at a time with SSE2 and dead ones are squeezed out in the same
+   pass. The frame takes a copy of the position, life and colour arrays, and
+   each array goes to the stream buffer as it is, read by its own instanced
+   attribute in Sample_GL_particle.vert, so all of them are one draw call.
+   --particle-benchmark N keeps N particles alive and reports the update time. */
+#define PARTICLE_BURST 256
+#define PARTICLE_GRAVITY 600.0f     // units/s^2
+#define PARTICLE_SIZE 4.0f          // units, shrinking over the last quarter second
+
+struct ParticleArrays {             // what a frame draws
+    vector<GLfloat> x, y, life;     // life in seconds left
+    vector<GLuint> colors;          // RGBA8
+};
+
+struct ParticleSystem {
+    ShaderProgram Program;
+    GLuint VPID, SizeID;
+    GLuint VertexArrayID;
+    ParticleArrays live;
+    vector<GLfloat> vx, vy;         // units/s
+    unsigned Random;                // xorshift state, the game's rand() is left alone
+    double LastUpdate;
+
+    int Benchmark;                  // particles kept alive with --particle-benchmark
+    long Spawned, Updates;
+    double UpdateMS, MaxUpdateMS, LiveSum;
+} particles;
+
+float particle_random ()
+{
+    if (!particles.Random)
+        particles.Random = 2463534242u;
+    particles.Random ^= particles.Random << 13;
+    particles.Random ^= particles.Random >> 17;
+    particles.Random ^= particles.Random << 5;
+    return (particles.Random >> 8) * (1.0f/16777216);
+}
+
+void particles_linked (GLuint program)
+{
+    particles.VPID = glGetUniformLocation(program, "VP");
+    particles.SizeID = glGetUniformLocation(program, "size");
+}
+
+void particles_init ()
+{
+    if (software.Enabled)
+        return;
+    program_start(particles.Program, "Sample_GL_particle.vert", "Sample_GL.frag", particles_linked);
+
+    // One instanced attribute per array, pointed at the stream buffer by particles_execute()
+    glGenVertexArrays(1, &particles.VertexArrayID);
+    state_bind_vertex_array (particles.VertexArrayID);
+    for (int a=0; a<4; a++) {
+        glEnableVertexAttribArray(a);
+        glVertexAttribDivisor(a, 1);
+    }
+}
+
+/* Throw count particles out of (x, y), in about the given colour */
+void particles_burst (float x, float y, COLOR color, int count)
+{
+    ParticleArrays& p = particles.live;
+    for (int i=0; i<count; i++) {
+        float angle = particle_random()*2*M_PI, speed = 60 + particle_random()*240;
+        float shade = 0.8f + particle_random()*0.4f;
+        p.x.push_back(x);
+        p.y.push_back(y);
+        p.life.push_back(0.4f + particle_random()*0.6f);
+        p.colors.push_back(quantize_color(min(color.r*shade, 1.0f)) | quantize_color(min(color.g*shade, 1.0f)) << 8
+                           | quantize_color(min(color.b*shade, 1.0f)) << 16 | 0xff000000u);
+        particles.vx.push_back(cos(angle)*speed);
+        particles.vy.push_back(sin(angle)*speed + 150);
+    }
+    particles.Spawned += count;
+}
+
+/* Top the benchmark back up to its count with bursts all over the playfield */
+void particles_benchmark ()
+{
+    while ((int) particles.live.x.size() < particles.Benchmark) {
+        COLOR color = {particle_random(), particle_random(), particle_random()};
+        particles_burst(particle_random()*1000 - 500, partition + particle_random()*(350 - partition), color,
+                        min(PARTICLE_BURST, particles.Benchmark - (int) particles.live.x.size()));
+    }
+}
+
+/* Move every particle on by the time since the last frame, dropping the dead */
+void particles_update ()
+{
+    double now = game_time();
+    float dt = min(now - particles.LastUpdate, 0.05);
+    particles.LastUpdate = now;
+
+    ParticleArrays& p = particles.live;
+    GLfloat *x = p.x.empty() ? NULL : &p.x[0], *y = p.y.empty() ? NULL : &p.y[0];
+    GLfloat *life = p.life.empty() ? NULL : &p.life[0];
+    GLfloat *vx = particles.vx.empty() ? NULL : &particles.vx[0], *vy = particles.vy.empty() ? NULL : &particles.vy[0];
+    GLuint* colors = p.colors.empty() ? NULL : &p.colors[0];
+    int n = p.x.size(), i = 0, w = 0;     // read and write positions, w never passes i
+
+#ifdef __SSE2__
+    __m128 step = _mm_set1_ps(dt), fall = _mm_set1_ps(-PARTICLE_GRAVITY*dt), zero = _mm_setzero_ps();
+    for (; i+4 <= n; i+=4) {
+        __m128 l = _mm_sub_ps(_mm_loadu_ps(life + i), step);
+        __m128 dx = _mm_loadu_ps(vx + i);
+        __m128 dy = _mm_add_ps(_mm_loadu_ps(vy + i), fall);
+        __m128 px = _mm_add_ps(_mm_loadu_ps(x + i), _mm_mul_ps(dx, step));
+        __m128 py = _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(dy, step));
+        int alive = _mm_movemask_ps(_mm_cmpgt_ps(l, zero));
+        if (alive == 15) {
+            _mm_storeu_ps(x + w, px);
+            _mm_storeu_ps(y + w, py);
+            _mm_storeu_ps(vx + w, dx);
+            _mm_storeu_ps(vy + w, dy);
+            _mm_storeu_ps(life + w, l);
+            _mm_storeu_si128((__m128i*) (colors + w), _mm_loadu_si128((__m128i*) (colors + i)));
+            w += 4;
+        }
+        else if (alive) {
+            GLfloat lanes[5][4];
+            _mm_storeu_ps(lanes[0], px);
+            _mm_storeu_ps(lanes[1], py);
+            _mm_storeu_ps(lanes[2], dx);
+            _mm_storeu_ps(lanes[3], dy);
+            _mm_storeu_ps(lanes[4], l);
+            for (int k=0; k<4; k++)
+                if (alive & 1 << k) {
+                    x[w] = lanes[0][k]; y[w] = lanes[1][k];
+                    vx[w] = lanes[2][k]; vy[w] = lanes[3][k];
+                    life[w] = lanes[4][k];
+                    colors[w++] = colors[i + k];
+                }
+        }
+    }
+#endif
+    for (; i<n; i++) {
+        GLfloat l = life[i] - dt;
+        if (l <= 0)
+            continue;
+        GLfloat dy = vy[i] - PARTICLE_GRAVITY*dt;
+        x[w] = x[i] + vx[i]*dt;
+        y[w] = y[i] + dy*dt;
+        vx[w] = vx[i];
+        vy[w] = dy;
+        life[w] = l;
+        colors[w++] = colors[i];
+    }
+    p.x.resize(w);
+    p.y.resize(w);
+    p.life.resize(w);
+    p.colors.resize(w);
+    particles.vx.resize(w);
+    particles.vy.resize(w);
+    if (particles.Benchmark)
+        particles_benchmark();
+
+    double ms = (game_time() - now)*1000;
+    particles.Updates++;
+    particles.UpdateMS += ms;
+    particles.MaxUpdateMS = max(particles.MaxUpdateMS, ms);
+    particles.LiveSum += p.x.size();
+}
+
+/* Record the live particles, render_submit() hands the frame a copy */
+void particles_draw (glm::mat4 VP)
+{
+    if (particles.live.x.empty())
+        return;
+    render_record(RENDER_PARTICLES, 0, particles.live.x.size(), VP, PASS_PARTICLES,
+                  render_key(LAYER_PARTICLES, particles.Program, particles.VertexArrayID, GL_FILL));
+}
+
+/* Draw every particle with a single instanced call */
+void particles_execute (const ParticleArrays& p, int count, glm::mat4 VP)
+{
+    if (software.Enabled) {
+        vector<CompactVertex> quads;
+        for (int i=0; i<count; i++) {
+            float half = PARTICLE_SIZE/2 * min(p.life[i]*4, 1.0f);
+            GLuint c = p.colors[i];
+            GLubyte r = c, g = c >> 8, b = c >> 16;
+            GLshort x0 = quantize_position(p.x[i] - half), x1 = quantize_position(p.x[i] + half);
+            GLshort y0 = quantize_position(p.y[i] - half), y1 = quantize_position(p.y[i] + half);
+            CompactVertex quad[4] = {{x0,y0, r,g,b,255}, {x0,y1, r,g,b,255}, {x1,y1, r,g,b,255}, {x1,y0, r,g,b,255}};
+            quads.insert(quads.end(), quad, quad + 4);
+        }
+        sw_draw(&quads[0], quads.size(), 1, VP * dequantize_matrix(), GL_FILL);
+        sprite_batch.DrawCalls++;
+        return;
+    }
+
+    // The four arrays back to back, 4 bytes a particle each
+    GLsizeiptr array = count*sizeof(GLfloat);
+    GLintptr offset;
+    char* dst = (char*) stream_map(4*array, sizeof(GLfloat), &offset);
+    memcpy(dst, &p.x[0], array);
+    memcpy(dst + array, &p.y[0], array);
+    memcpy(dst + 2*array, &p.life[0], array);
+    memcpy(dst + 3*array, &p.colors[0], array);
+    stream_unmap();
+
+    state_bind_vertex_array (particles.VertexArrayID);
+    state_bind_array_buffer (stream.Buffer);
+    glVertexAttribPointer(0, 1, GL_FLOAT, GL_FALSE, 0, (void*)offset);
+    glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 0, (void*)(offset + array));
+    glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, 0, (void*)(offset + 2*array));
+    glVertexAttribPointer(3, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, (void*)(offset + 3*array));
+
+    program_use (particles.Program);
+    glUniformMatrix4fv(particles.VPID, 1, GL_FALSE, &VP[0][0]);
+    glUniform1f(particles.SizeID, PARTICLE_SIZE);
+    state_polygon_mode (GL_FILL);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+    sprite_batch.DrawCalls++;
+}
+
+/* Whole run summary */
+void particles_finish ()
+{
+    if (!particles.Updates || !particles.Spawned)
+        return;
+    double ms = particles.UpdateMS/particles.Updates, live = particles.LiveSum/particles.Updates;
+    printf("Particles: %ld spawned, %.0f alive on average, update %.3f ms average, %.3f ms longest, %.1f million a second\n",
+           particles.Spawned, live, ms, particles.MaxUpdateMS, ms > 0 ? live/ms/1000 : 0.0);
+}
+
+/*******************
+ * Static scene    *
+ *******************/
+/* The mainline, cannon, buckets, mirrors and scoreboard segments live in one
+   vertex/index buffer. Each frame their model matrices go to one texture
+   buffer and all of them are sent with one glMultiDrawElementsIndirect per
+   fill mode. The shader picks its matrix by draw ID, which reaches it as an
+   instanced attribute through baseInstance. GL 3.3 contexts fall back to one
+   glDrawElementsBaseVertex per object with the draw ID set directly. Each
+   object keeps its layer, so the scene is one command per layer it shows
+   up in. The objects registered as cached are drawn by the background
+   cache instead. */
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;       // 1 when visible this frame, 0 when hidden
+    GLuint firstIndex;
+    GLint  baseVertex;
+    GLuint baseInstance;        // the object's draw ID
+};
+
+struct StaticScene {
+    ShaderProgram Program;
+    GLuint VPID;                // "VP" uniform of the scene program
+    GLuint VertexArrayID;
+    GLuint VertexBuffer;
+    GLuint IndexBuffer;
+    GLuint DrawIDBuffer;        // 0,1,2,.. read through baseInstance
+    GLuint IndirectBuffer;
+    GLuint MatrixBuffer;        // 4 RGBA32F texels (columns) per object
+    GLuint MatrixTexture;
+    int Indirect;               // 1 when multi draw indirect is available
+
+    vector<VAO*> objects;
+    vector<int> passes;         // profiler pass of each object
+    vector<int> layers;         // enum Layer of each object
+    vector<int> cached;         // drawn by the background cache, when it is on
+    vector<GLenum> fill_modes;
+    vector<DrawElementsIndirectCommand> commands;
+    vector<int> command_of;     // index in commands of each object
+    vector<glm::mat4> matrices;
+    vector<DrawElementsIndirectCommand> drawn;  // render thread, see static_scene_execute()
+} static_scene;
+
+void static_scene_linked (GLuint program)
+{
+    static_scene.VPID = glGetUniformLocation(program, "VP");
+    state_use_program(program);
+    glUniform1i(glGetUniformLocation(program, "modelMatrices"), 0);
+}
+
+void static_scene_init ()
+{
+    if (software.Enabled)
+        return;
+
+    program_start(static_scene.Program, "Sample_GL_scene.vert", "Sample_GL.frag", static_scene_linked);
+    static_scene.Indirect = GLAD_GL_VERSION_4_3 || (GLAD_GL_ARB_multi_draw_indirect && GLAD_GL_ARB_base_instance);
+    cout << "Static scene: " << (static_scene.Indirect ? "multi draw indirect" : "GL 3.3 fallback") << endl;
+}
+
+/* Register a sprite, remembering its draw ID in obj.scene_id. Cached ones should rarely change. */
+void static_scene_add (Sprite& obj, int pass, int layer, int cached = 0)
+{
+    obj.scene_id = static_scene.objects.size();
+    static_scene.objects.push_back(obj.object);
+    static_scene.passes.push_back(pass);
+    static_scene.layers.push_back(layer);
+    static_scene.cached.push_back(cached);
+}
+
+/* Upload the geometry of every registered sprite, call once after the last static_scene_add */
+void static_scene_build ()
+{
+    vector<CompactVertex> vertices;
+    vector<GLushort> indices;
+    int n = static_scene.objects.size();
+    static_scene.command_of.resize(n);
+
+    // Commands are grouped by fill mode so each group is one multi draw
+    GLenum modes[2] = {GL_FILL, GL_LINE};
+    for (int m=0; m<2; m++)
+    for (int id=0; id<n; id++) {
+        VAO* vao = static_scene.objects[id];
+        if (vao->FillMode != modes[m])
+            continue;
+
+        DrawElementsIndirectCommand cmd;
+        cmd.firstIndex = indices.size();
+        cmd.baseVertex = vertices.size();
+        cmd.instanceCount = 0;
+        cmd.baseInstance = id;
+        for (int v=0; v<vao->NumVertices; v++)
+            vertices.push_back(vao->Vertices[v]);
+        if (vao->NumIndices) {
+            for (int q=0; q<vao->NumIndices/6; q++) {
+                GLushort quad[6] = {0, 1, 2, 2, 3, 0};
+                for (int k=0; k<6; k++)
+                    indices.push_back(4*q + quad[k]);
+            }
+            cmd.count = vao->NumIndices;
+        }
+        else {
+            for (int v=0; v<vao->NumVertices; v++)
+                indices.push_back(v);
+            cmd.count = vao->NumVertices;
+        }
+        static_scene.command_of[id] = static_scene.commands.size();
+        static_scene.commands.push_back(cmd);
+        static_scene.fill_modes.push_back(modes[m]);
+    }
+    static_scene.matrices.resize(n);
+    if (software.Enabled)
+        return;
+
+    vector<GLint> draw_ids(n);
+    for (int id=0; id<n; id++)
+        draw_ids[id] = id;
+
+    glGenVertexArrays(1, &static_scene.VertexArrayID);
+    glGenBuffers(1, &static_scene.VertexBuffer);
+    glGenBuffers(1, &static_scene.IndexBuffer);
+    glGenBuffers(1, &static_scene.DrawIDBuffer);
+    glGenBuffers(1, &static_scene.IndirectBuffer);
+    glGenBuffers(1, &static_scene.MatrixBuffer);
+    glGenTextures(1, &static_scene.MatrixTexture);
+
+    state_bind_vertex_array (static_scene.VertexArrayID);
+    state_bind_array_buffer (static_scene.VertexBuffer);
+    glBufferData (GL_ARRAY_BUFFER, vertices.size()*sizeof(CompactVertex), &vertices[0], GL_STATIC_DRAW);
+    compact_vertex_attributes();
+    glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, static_scene.IndexBuffer);
+    glBufferData (GL_ELEMENT_ARRAY_BUFFER, indices.size()*sizeof(GLushort), &indices[0], GL_STATIC_DRAW);
+
+    // Without base instance the draw ID is set per draw as a constant attribute
+    if (static_scene.Indirect) {
+        state_bind_array_buffer (static_scene.DrawIDBuffer);
+        glBufferData (GL_ARRAY_BUFFER, n*sizeof(GLint), &draw_ids[0], GL_STATIC_DRAW);
+        glEnableVertexAttribArray(4);
+        glVertexAttribIPointer(4, 1, GL_INT, 0, (void*)0);
+        glVertexAttribDivisor(4, 1);
+
+        glBindBuffer (GL_DRAW_INDIRECT_BUFFER, static_scene.IndirectBuffer);
+        glBufferData (GL_DRAW_INDIRECT_BUFFER, static_scene.commands.size()*sizeof(DrawElementsIndirectCommand), NULL, GL_DYNAMIC_DRAW);
+    }
+
+    glBindBuffer (GL_TEXTURE_BUFFER, static_scene.MatrixBuffer);
+    glBufferData (GL_TEXTURE_BUFFER, n*sizeof(glm::mat4), NULL, GL_DYNAMIC_DRAW);
+    glBindTexture (GL_TEXTURE_BUFFER, static_scene.MatrixTexture);
+    glTexBuffer (GL_TEXTURE_BUFFER, GL_RGBA32F, static_scene.MatrixBuffer);
+}
+
+/* Hide every object, the ones updated before static_scene_draw() are shown */
+void static_scene_begin ()
+{
+    for (size_t c=0; c<static_scene.commands.size(); c++)
+        static_scene.commands[c].instanceCount = 0;
+}
+
+/* Show a registered sprite this frame at its current transform */
+void static_scene_update (Sprite obj)
+{
+    glm::mat4 model = sprite_model(obj);
+    VAO* vao = obj.object;
+    if (!cull_visible(model, vao->MinX, vao->MinY, vao->MaxX, vao->MaxY))
+        return;
+    static_scene.matrices[obj.scene_id] = model * dequantize_matrix();
+    static_scene.commands[static_scene.command_of[obj.scene_id]].instanceCount = 1;
+}
+
+/* Send the scene, one command per layer with objects shown. skip_cached leaves
+   out the ones the background cache draws. */
+void static_scene_draw (glm::mat4 VP, int skip_cached)
+{
+    unsigned layers = 0;
+    for (size_t c=0; c<static_scene.commands.size(); c++) {
+        GLuint id = static_scene.commands[c].baseInstance;
+        if (static_scene.commands[c].instanceCount && !(skip_cached && static_scene.cached[id]))
+            layers |= 1u << static_scene.layers[id];
+    }
+    for (int layer=0; layers; layer++, layers >>= 1)
+        if (layers & 1)
+            render_record(RENDER_STATIC_SCENE, layer, 0, VP, -1,
+                          render_key(layer, static_scene.Program, static_scene.VertexArrayID, GL_FILL));
+}
+
+/* Draw the scene as it was recorded: its matrices and which objects were shown.
+   layer picks the objects of one layer, -1 all of them, and cached the ones
+   of the background cache: 1 the cached ones, 0 the others, -1 all of them. */
+void static_scene_execute (const vector<glm::mat4>& matrices, const vector<DrawElementsIndirectCommand>& scene_commands,
+                           glm::mat4 VP, int layer, int cached)
+{
+    int n = scene_commands.size();
+    if (n == 0)
+        return;
+
+    vector<DrawElementsIndirectCommand>& commands = static_scene.drawn;
+    commands = scene_commands;
+    for (int c=0; c<n; c++) {
+        GLuint id = commands[c].baseInstance;
+        if ((layer >= 0 && static_scene.layers[id] != layer) || (cached >= 0 && static_scene.cached[id] != cached))
+            commands[c].instanceCount = 0;
+    }
+
+    if (software.Enabled) {
+        for (int c=0; c<n; c++) {
+            DrawElementsIndirectCommand cmd = commands[c];
+            if (!cmd.instanceCount)
+                continue;
+            VAO* vao = static_scene.objects[cmd.baseInstance];
+            sw_draw(vao->Vertices, vao->NumVertices, vao->NumIndices > 0,
+                    VP * matrices[cmd.baseInstance], vao->FillMode);
         }
+        return;
     }
-    if(ctrl && kleft_click)
-    {
-      bucket["red"].dx=-1*bucket_speed;
-      bucket["red"].key_press=1;
+
+    glBindBuffer (GL_TEXTURE_BUFFER, static_scene.MatrixBuffer);
+    glBufferSubData (GL_TEXTURE_BUFFER, 0, matrices.size()*sizeof(glm::mat4), &matrices[0]);
+
+    program_use (static_scene.Program);
+    glUniformMatrix4fv(static_scene.VPID, 1, GL_FALSE, &VP[0][0]);
+    glActiveTexture (GL_TEXTURE0);
+    glBindTexture (GL_TEXTURE_BUFFER, static_scene.MatrixTexture);
+    state_bind_vertex_array (static_scene.VertexArrayID);
+
+    if (static_scene.Indirect) {
+        glBindBuffer (GL_DRAW_INDIRECT_BUFFER, static_scene.IndirectBuffer);
+        glBufferSubData (GL_DRAW_INDIRECT_BUFFER, 0, n*sizeof(DrawElementsIndirectCommand), &commands[0]);
     }
-    else if(ctrl && kright_click)
-    {
-      bucket["red"].dx=bucket_speed;
-      bucket["red"].key_press=1;
+
+    // One submission per run of commands sharing a fill mode, and a pass when profiling
+    for (int first=0, last; first<n; first=last) {
+        int pass = static_scene.passes[commands[first].baseInstance];
+        for (last=first; last<n && static_scene.fill_modes[last]==static_scene.fill_modes[first] &&
+             (!profiler.Enabled || static_scene.passes[commands[last].baseInstance]==pass); last++);
+        state_polygon_mode (static_scene.fill_modes[first]);
+        profile_begin(pass);
+        if (static_scene.Indirect) {
+            glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT,
+                                        (void*)(first*sizeof(DrawElementsIndirectCommand)), last-first, 0);
+            profile_end();
+            continue;
+        }
+        for (int c=first; c<last; c++) {
+            DrawElementsIndirectCommand cmd = commands[c];
+            if (!cmd.instanceCount)
+                continue;
+            glVertexAttribI1i(4, cmd.baseInstance);
+            glDrawElementsBaseVertex(GL_TRIANGLES, cmd.count, GL_UNSIGNED_SHORT,
+                                     (void*)(cmd.firstIndex*sizeof(GLushort)), cmd.baseVertex);
+        }
+        profile_end();
     }
-    else
-    {
-      bucket["red"].dx=0;
-      bucket["red"].key_press=0;
+}
+
+/*********************
+ * Background cache  *
+ *********************/
+/* The mainline and the mirrors hardly ever change, so they are drawn once
+   over the clear colour into an offscreen framebuffer the size of the
+   frame, and each frame starts with a straight copy of it instead of a
+   clear. It is drawn again only when the camera, one of their matrices,
+   which of them are shown, or the frame size changes. The software
+   renderer keeps a copy of its pixels instead. Being the background, the
+   mirrors are drawn under the lasers, bricks and particles rather than over
+   them; the cannon and the buckets move too often to be cached and keep
+   their layer. --no-background-cache draws all of it with the static scene
+   every frame, in the original order. */
+struct BackgroundCache {
+    int Enabled;
+    GLuint Framebuffer;
+    GLuint Renderbuffer;
+
+    // Render thread, what the cache holds
+    int Valid;
+    int Width, Height;
+    GLint Target;               // framebuffer the frame is drawn to at this size
+    glm::mat4 VP;
+    vector<glm::mat4> matrices;
+    vector<GLuint> shown;       // instanceCount of each scene command
+    vector<GLuint> pixels;      // with --software
+    long Drawn, Reused;
+} background = {1};
+
+void background_init ()
+{
+    if (!background.Enabled || software.Enabled)
+        return;
+    // The renderbuffer gets its size from background_execute()
+    glGenFramebuffers(1, &background.Framebuffer);
+    glGenRenderbuffers(1, &background.Renderbuffer);
+}
+
+/* Record the background, under everything else of the frame */
+void background_draw (glm::mat4 VP)
+{
+    if (background.Enabled)
+        render_record(RENDER_BACKGROUND, 0, 0, VP, -1, render_key(LAYER_BACKGROUND, static_scene.Program, 0, GL_FILL));
+}
+
+/* Does the cache still show these cached objects, at this size? */
+int background_valid (const vector<glm::mat4>& matrices, const vector<DrawElementsIndirectCommand>& commands,
+                      glm::mat4 VP, int width, int height)
+{
+    if (!background.Valid || width != background.Width || height != background.Height
+        || memcmp(&VP, &background.VP, sizeof(VP)) != 0 || commands.size() != background.shown.size())
+        return 0;
+    for (size_t c=0; c<commands.size(); c++) {
+        GLuint id = commands[c].baseInstance;
+        if (!static_scene.cached[id])
+            continue;
+        if (commands[c].instanceCount != background.shown[c]
+            || (commands[c].instanceCount && memcmp(&matrices[id], &background.matrices[id], sizeof(glm::mat4)) != 0))
+            return 0;
     }
+    return 1;
+}
 
-    if(alt && kleft_click)
-    {
-      bucket["green"].dx=-1*bucket_speed;
-      bucket["green"].key_press=1;
+/* Draw the cached objects again if they changed, then copy the cache to the frame */
+void background_execute (const vector<glm::mat4>& matrices, const vector<DrawElementsIndirectCommand>& commands, glm::mat4 VP)
+{
+    // The frame's viewport, which resolution_begin_frame() has set up
+    int width = resolution.Enabled ? resolution.ViewWidth : resolution.OutputWidth;
+    int height = resolution.Enabled ? resolution.ViewHeight : resolution.OutputHeight;
+    int valid = background_valid(matrices, commands, VP, width, height), resized = 0;
+    if (valid)
+        background.Reused++;
+    else {
+        background.Drawn++;
+        background.Valid = 1;
+        resized = width != background.Width || height != background.Height;
+        background.Width = width;
+        background.Height = height;
+        background.VP = VP;
+        background.matrices = matrices;
+        background.shown.resize(commands.size());
+        for (size_t c=0; c<commands.size(); c++)
+            background.shown[c] = commands[c].instanceCount;
     }
-     else if(alt && kright_click)
-    {
-      bucket["green"].dx=bucket_speed;
-      bucket["green"].key_press=1;
+
+    if (software.Enabled) {
+        // The frame was just cleared, draw on it and keep a copy. It is cleared
+        // anyway: the copy costs as much as the clear, and the rest of it is alike.
+        if (valid)
+            software.pixels = background.pixels;
+        else {
+            static_scene_execute(matrices, commands, VP, -1, 1);
+            background.pixels = software.pixels;
+        }
+        return;
     }
-    else
-    {
-      bucket["green"].dx=0;
-      bucket["green"].key_press=0;
+
+    if (!valid) {
+        // The frame size only changes with the framebuffer drawn to, so it is looked up here
+        if (resized) {
+            glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &background.Target);
+            glBindRenderbuffer(GL_RENDERBUFFER, background.Renderbuffer);
+            glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+            glBindFramebuffer(GL_FRAMEBUFFER, background.Framebuffer);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, background.Renderbuffer);
+        }
+        else
+            glBindFramebuffer(GL_FRAMEBUFFER, background.Framebuffer);
+        glClear(GL_COLOR_BUFFER_BIT);
+        static_scene_execute(matrices, commands, VP, -1, 1);
+        glBindFramebuffer(GL_FRAMEBUFFER, background.Target);
     }
+
+    // Pixel for pixel, a blit is a plain copy where a textured quad would be shaded
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, background.Framebuffer);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, background.Target);
 }
 
-/* Executed for character input (like in text boxes) */
-void keyboardChar (GLFWwindow* window, unsigned int key)
+/* Whole run summary, once the render thread is done */
+void background_finish ()
 {
-	switch (key) {
-		case 'Q':
-		case 'q':
-            quit(window);
-            break;
-		default:
-			break;
-	}
+    if (background.Drawn)
+        printf("Background cache: drawn %ld times, reused in %ld frames\n", background.Drawn, background.Reused);
 }
 
-string move;
-/* Executed when a mouse button is pressed/released */
-void mouseButton (GLFWwindow* window, int button, int action, int mods)
+/*****************
+ * Text          *
+ *****************/
+/* Strings are drawn from a 5x7 monospace bitmap font, rasterized once into
+   an atlas texture. Every character is one instance (corner, size, colour
+   and glyph) of a quad that Sample_GL_text.vert builds from gl_VertexID,
+   so any amount of text is a single instanced draw. Glyphs sit in 6x8
+   cells, spacing included, and are sampled nearest so they stay sharp at
+   any size. */
+#define GLYPH_COLUMNS 16        // atlas layout, in cells
+#define GLYPH_ROWS 6
+#define GLYPH_WIDTH 6           // cell size, in font pixels
+#define GLYPH_HEIGHT 8
+
+// ' ' to '~', one byte per column with the top row in bit 0
+const unsigned char font5x7[95][5] = {
+    {0x00,0x00,0x00,0x00,0x00}, {0x00,0x00,0x5F,0x00,0x00}, {0x00,0x07,0x00,0x07,0x00}, {0x14,0x7F,0x14,0x7F,0x14},
+    {0x24,0x2A,0x7F,0x2A,0x12}, {0x23,0x13,0x08,0x64,0x62}, {0x36,0x49,0x55,0x22,0x50}, {0x00,0x05,0x03,0x00,0x00},
+    {0x00,0x1C,0x22,0x41,0x00}, {0x00,0x41,0x22,0x1C,0x00}, {0x08,0x2A,0x1C,0x2A,0x08}, {0x08,0x08,0x3E,0x08,0x08},
+    {0x00,0x50,0x30,0x00,0x00}, {0x08,0x08,0x08,0x08,0x08}, {0x00,0x60,0x60,0x00,0x00}, {0x20,0x10,0x08,0x04,0x02},
+    {0x3E,0x51,0x49,0x45,0x3E}, {0x00,0x42,0x7F,0x40,0x00}, {0x42,0x61,0x51,0x49,0x46}, {0x21,0x41,0x45,0x4B,0x31},
+    {0x18,0x14,0x12,0x7F,0x10}, {0x27,0x45,0x45,0x45,0x39}, {0x3C,0x4A,0x49,0x49,0x30}, {0x01,0x71,0x09,0x05,0x03},
+    {0x36,0x49,0x49,0x49,0x36}, {0x06,0x49,0x49,0x29,0x1E}, {0x00,0x36,0x36,0x00,0x00}, {0x00,0x56,0x36,0x00,0x00},
+    {0x08,0x14,0x22,0x41,0x00}, {0x14,0x14,0x14,0x14,0x14}, {0x00,0x41,0x22,0x14,0x08}, {0x02,0x01,0x51,0x09,0x06},
+    {0x32,0x49,0x79,0x41,0x3E}, {0x7E,0x11,0x11,0x11,0x7E}, {0x7F,0x49,0x49,0x49,0x36}, {0x3E,0x41,0x41,0x41,0x22},
+    {0x7F,0x41,0x41,0x22,0x1C}, {0x7F,0x49,0x49,0x49,0x41}, {0x7F,0x09,0x09,0x01,0x01}, {0x3E,0x41,0x41,0x51,0x32},
+    {0x7F,0x08,0x08,0x08,0x7F}, {0x00,0x41,0x7F,0x41,0x00}, {0x20,0x40,0x41,0x3F,0x01}, {0x7F,0x08,0x14,0x22,0x41},
+    {0x7F,0x40,0x40,0x40,0x40}, {0x7F,0x02,0x04,0x02,0x7F}, {0x7F,0x04,0x08,0x10,0x7F}, {0x3E,0x41,0x41,0x41,0x3E},
+    {0x7F,0x09,0x09,0x09,0x06}, {0x3E,0x41,0x51,0x21,0x5E}, {0x7F,0x09,0x19,0x29,0x46}, {0x46,0x49,0x49,0x49,0x31},
+    {0x01,0x01,0x7F,0x01,0x01}, {0x3F,0x40,0x40,0x40,0x3F}, {0x1F,0x20,0x40,0x20,0x1F}, {0x7F,0x20,0x18,0x20,0x7F},
+    {0x63,0x14,0x08,0x14,0x63}, {0x03,0x04,0x78,0x04,0x03}, {0x61,0x51,0x49,0x45,0x43}, {0x00,0x7F,0x41,0x41,0x00},
+    {0x02,0x04,0x08,0x10,0x20}, {0x00,0x41,0x41,0x7F,0x00}, {0x04,0x02,0x01,0x02,0x04}, {0x40,0x40,0x40,0x40,0x40},
+    {0x00,0x01,0x02,0x04,0x00}, {0x20,0x54,0x54,0x54,0x78}, {0x7F,0x48,0x44,0x44,0x38}, {0x38,0x44,0x44,0x44,0x20},
+    {0x38,0x44,0x44,0x48,0x7F}, {0x38,0x54,0x54,0x54,0x18}, {0x08,0x7E,0x09,0x01,0x02}, {0x0C,0x52,0x52,0x52,0x3E},
+    {0x7F,0x08,0x04,0x04,0x78}, {0x00,0x44,0x7D,0x40,0x00}, {0x20,0x40,0x44,0x3D,0x00}, {0x7F,0x10,0x28,0x44,0x00},
+    {0x00,0x41,0x7F,0x40,0x00}, {0x7C,0x04,0x18,0x04,0x78}, {0x7C,0x08,0x04,0x04,0x78}, {0x38,0x44,0x44,0x44,0x38},
+    {0x7C,0x14,0x14,0x14,0x08}, {0x08,0x14,0x14,0x18,0x7C}, {0x7C,0x08,0x04,0x04,0x08}, {0x48,0x54,0x54,0x54,0x20},
+    {0x04,0x3F,0x44,0x40,0x20}, {0x3C,0x40,0x40,0x20,0x7C}, {0x1C,0x20,0x40,0x20,0x1C}, {0x3C,0x40,0x30,0x40,0x3C},
+    {0x44,0x28,0x10,0x28,0x44}, {0x0C,0x50,0x50,0x50,0x3C}, {0x44,0x64,0x54,0x4C,0x44}, {0x00,0x08,0x36,0x41,0x00},
+    {0x00,0x00,0x7F,0x00,0x00}, {0x00,0x41,0x36,0x08,0x00}, {0x08,0x04,0x08,0x10,0x08}
+};
+
+struct TextGlyph {
+    GLfloat x, y;               // bottom left corner of the cell
+    GLfloat size;               // of one font pixel
+    GLubyte r, g, b, glyph;     // glyph counts from ' '
+};
+
+struct TextRenderer {
+    ShaderProgram Program;
+    GLuint VPID;
+    GLuint Atlas;
+    GLuint VertexArrayID;
+    vector<TextGlyph> glyphs;
+    int Recorded;               // glyphs already covered by a render command
+} text_renderer;
+
+void text_linked (GLuint program)
 {
-  Sprite b1=bucket["red"],b2=bucket["green"],c1=cannon["main"],c2=cannon["front"];
-    switch (button) {
-        case GLFW_MOUSE_BUTTON_LEFT:
-            if (action == GLFW_PRESS)
-            {
-              mleft_click=1;
-              glfwGetCursorPos(window, &new_mouse_pos_x, &new_mouse_pos_y);
-              new_mouse_pos_x=new_mouse_pos_x-500;
-              new_mouse_pos_y=new_mouse_pos_y*-1+350;
-              if(abs(new_mouse_pos_x-b1.x)<b1.width/2 && abs(new_mouse_pos_y-b1.y)<b1.height/2)
-                move="red";
-              else if(abs(new_mouse_pos_x-b2.x)<b2.width/2 && abs(new_mouse_pos_y-b2.y)<b2.height/2)
-                move="green";
-              else if(abs(new_mouse_pos_x-c1.x)<c1.width/2 && abs(new_mouse_pos_y-c1.y)<c1.height/2)
-                move="cmain";
-              else
-                move="dont";
-            }
-            if (action == GLFW_RELEASE)
-            {
-              mleft_click=0;
-              float cur_angle;
-              glfwGetCursorPos(window, &new_mouse_pos_x, &new_mouse_pos_y);
-              new_mouse_pos_x=new_mouse_pos_x-500;
-              new_mouse_pos_y=new_mouse_pos_y*-1+350;
-              cur_angle=atan((new_mouse_pos_y-c2.y)/(new_mouse_pos_x-c2.x))*180/M_PI;
-              if(new_mouse_pos_x>(c2.x) && new_mouse_pos_y>partition)
-              {
-                // cout<<"hello"<<cur_angle;
-                if(current_time-laz_old_time>1)
-                {
-                  cannon["front"].rot_angle=cur_angle;
-                  create_lazer(laz_no/2);
-                  laz_no++;
-                  laz_old_time=current_time;
+    text_renderer.VPID = glGetUniformLocation(program, "VP");
+    state_use_program(program);
+    glUniform1i(glGetUniformLocation(program, "atlas"), 1);
+}
+
+void text_init ()
+{
+    if (software.Enabled)
+        return;
+
+    // One byte per texel, each glyph in the top left of its cell
+    int width = GLYPH_COLUMNS*GLYPH_WIDTH, height = GLYPH_ROWS*GLYPH_HEIGHT;
+    vector<GLubyte> atlas(width*height, 0);
+    for (int c=0; c<95; c++)
+        for (int x=0; x<5; x++)
+            for (int y=0; y<7; y++)
+                if (font5x7[c][x] >> y & 1)
+                    atlas[(c/GLYPH_COLUMNS*GLYPH_HEIGHT + y)*width + c%GLYPH_COLUMNS*GLYPH_WIDTH + x] = 255;
+
+    // Texture unit 1 keeps the atlas, unit 0 belongs to the static scene
+    glGenTextures(1, &text_renderer.Atlas);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, text_renderer.Atlas);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, width, height, 0, GL_RED, GL_UNSIGNED_BYTE, &atlas[0]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glActiveTexture(GL_TEXTURE0);
+
+    program_start(text_renderer.Program, "Sample_GL_text.vert", "Sample_GL_text.frag", text_linked);
+
+    // No vertex data, the corners come from gl_VertexID
+    // and the glyphs from the stream buffer, see text_execute()
+    glGenVertexArrays(1, &text_renderer.VertexArrayID);
+    state_bind_vertex_array (text_renderer.VertexArrayID);
+    glEnableVertexAttribArray(0);
+    glVertexAttribDivisor(0, 1);
+    glEnableVertexAttribArray(1);
+    glVertexAttribDivisor(1, 1);
+}
+
+float text_width (const char* str, float size)
+{
+    return strlen(str)*GLYPH_WIDTH*size;
+}
+
+/* Queue a string with the bottom left corner of its first cell at (x, y) */
+void text_add (const char* str, float x, float y, float size, COLOR color)
+{
+    GLubyte r = quantize_color(color.r), g = quantize_color(color.g), b = quantize_color(color.b);
+    for (; *str; str++, x += GLYPH_WIDTH*size) {
+        int c = (unsigned char) *str;
+        if (c <= ' ' || c > '~')
+            continue;           // blank, it only takes its place
+        TextGlyph glyph = {x, y, size, r, g, b, (GLubyte)(c - ' ')};
+        text_renderer.glyphs.push_back(glyph);
+    }
+}
+
+/* Record every glyph queued since the last call */
+void text_draw (glm::mat4 VP, int pass)
+{
+    int count = text_renderer.glyphs.size() - text_renderer.Recorded;
+    if (count == 0)
+        return;
+    render_record(RENDER_TEXT, text_renderer.Recorded, count, VP, pass,
+                  render_key(LAYER_HUD, text_renderer.Program, text_renderer.VertexArrayID, GL_FILL));
+    text_renderer.Recorded += count;
+}
+
+/* Draw glyphs with a single instanced call */
+void text_execute (const TextGlyph* glyphs, int count, glm::mat4 VP)
+{
+    if (software.Enabled) {
+        // Without an atlas, every lit font pixel is a quad of its own
+        vector<CompactVertex> quads;
+        for (int i=0; i<count; i++) {
+            TextGlyph t = glyphs[i];
+            for (int x=0; x<5; x++)
+                for (int y=0; y<7; y++) {
+                    if (!(font5x7[t.glyph][x] >> y & 1))
+                        continue;
+                    GLshort x0 = quantize_position(t.x + x*t.size), x1 = quantize_position(t.x + (x+1)*t.size);
+                    GLshort y0 = quantize_position(t.y + (GLYPH_HEIGHT-y-1)*t.size), y1 = quantize_position(t.y + (GLYPH_HEIGHT-y)*t.size);
+                    CompactVertex quad[4] = {{x0,y0, t.r,t.g,t.b,255}, {x0,y1, t.r,t.g,t.b,255}, {x1,y1, t.r,t.g,t.b,255}, {x1,y0, t.r,t.g,t.b,255}};
+                    quads.insert(quads.end(), quad, quad + 4);
                 }
-              }
-            }
-            break;
-        case GLFW_MOUSE_BUTTON_RIGHT:
-            if (action == GLFW_PRESS) {
-                mright_click=1;
+        }
+        if (!quads.empty())
+            sw_draw(&quads[0], quads.size(), 1, VP * dequantize_matrix(), GL_FILL);
+        sprite_batch.DrawCalls++;
+        return;
+    }
+
+    GLintptr offset;
+    memcpy(stream_map(count*sizeof(TextGlyph), sizeof(TextGlyph), &offset), glyphs, count*sizeof(TextGlyph));
+    stream_unmap();
+    state_bind_vertex_array (text_renderer.VertexArrayID);
+    state_bind_array_buffer (stream.Buffer);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(TextGlyph), (void*)offset);
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(TextGlyph), (void*)(offset + 3*sizeof(GLfloat)));
+
+    program_use (text_renderer.Program);
+    glUniformMatrix4fv(text_renderer.VPID, 1, GL_FALSE, &VP[0][0]);
+    state_polygon_mode (GL_FILL);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+    sprite_batch.DrawCalls++;
+}
+
+/*****************
+ * HUD           *
+ *****************/
+/* Score, miss-hits and the end of game messages, drawn over everything in
+   fixed screen space whatever the zoom and pan are. The debug line is
+   refreshed by show_stats(). */
+struct Hud {
+    const char* Message;        // win or lose, NULL while neither
+    double GameOver;            // when the game ended, 0 while it goes on
+    string Debug;               // frame rate and renderer counters
+} hud;
+
+/* Queue a line centered on x = 0 */
+void hud_centered (const char* str, float y, float size, COLOR color)
+{
+    text_add(str, -text_width(str, size)/2, y, size, color);
+}
+
+void draw_hud ()
+{
+    char line[64];
+    snprintf(line, sizeof(line), "SCORE %lld", score);
+    text_add(line, 490 - text_width(line, 3), 320, 3, black);
+    snprintf(line, sizeof(line), "MISS-HITS LEFT %lld", max(mis_hit, 0LL));
+    text_add(line, 490 - text_width(line, 2), 298, 2, black);
+    text_add(hud.Debug.c_str(), -490, 334, 2, grey);
+
+    if (hud.Message)
+        hud_centered(hud.Message, 150, 4, darkpink);
+    if (hud.GameOver) {
+        hud_centered("GAME OVER", 20, 8, darkpink);
+        snprintf(line, sizeof(line), "Final score %lld", score);
+        hud_centered(line, -30, 4, black);
+    }
+
+    text_draw(glm::ortho(-500.0f, 500.0f, -350.0f, 350.0f, 0.1f, 500.0f) *
+              glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)), PASS_HUD);
+}
+
+/* Print the final score, main() leaves the last frame up for a moment and quits */
+void game_over ()
+{
+    if (hud.GameOver)
+        return;
+    cout<<"Final score is: "<<score<<endl;
+    cout<<"Game Over\n";
+    hud.GameOver = game_time();
+}
+
+/*****************
+ * Shader reload *
+ *****************/
+/* --watch-shaders watches the shader files with inotify. The main loop
+   reads the events and the render thread rebuilds the programs using a
+   changed file at its next frame boundary. The driver compiles them in
+   the background while frames go on with the running programs, and a
+   rebuilt program replaces its running one at a frame boundary, only if
+   it linked. The average frame time of the RELOAD_WINDOW frames before
+   and after each swap is printed: GPU time with --profile, the render
+   thread's time per frame otherwise. */
+#define RELOAD_WINDOW 120
+
+struct ReloadTarget {
+    ShaderProgram* Live;
+    ShaderProgram Next;         // its rebuild, while Building
+    int Building;
+};
+
+struct ShaderReload {
+    int Enabled;
+    int Fd;                     // inotify
+    vector<int> watches;
+    vector<string> watch_dirs;  // path prefix of the files of each watch
+    vector<ReloadTarget> targets;
+
+    pthread_mutex_t Lock;       // for changed and Busy, main thread to render thread
+    vector<string> changed;     // files written since the render thread looked
+    int Busy;                   // rebuilds in flight
+
+    // Render thread only
+    float times[RELOAD_WINDOW]; // frame times since the last swap
+    int TimeCount, TimeNext;
+    float Before;               // average before the last swap, -1 once reported
+    string Swapped;             // what the last swap changed
+} shader_reload = {0, -1};
+
+void shader_reload_watch (ShaderProgram& program)
+{
+    ReloadTarget target = {&program};
+    shader_reload.targets.push_back(target);
+
+    const char* paths[2] = {program.VertexPath, program.FragmentPath};
+    for (int p=0; p<2; p++) {
+        const char* slash = strrchr(paths[p], '/');
+        string dir = slash ? string(paths[p], slash + 1 - paths[p]) : "";
+        int watched = 0;
+        for (size_t w=0; w<shader_reload.watch_dirs.size(); w++)
+            watched |= shader_reload.watch_dirs[w] == dir;
+        if (watched)
+            continue;
+        // Editors often save to a new file and rename it over the old one
+        int wd = inotify_add_watch(shader_reload.Fd, dir.empty() ? "." : dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0) {
+            fprintf(stderr, "Warning: can not watch %s for shader changes\n", dir.empty() ? "." : dir.c_str());
+            continue;
+        }
+        shader_reload.watches.push_back(wd);
+        shader_reload.watch_dirs.push_back(dir);
+    }
+}
+
+void shader_reload_init ()
+{
+    if (software.Enabled) {
+        fprintf(stderr, "Warning: --watch-shaders needs OpenGL, ignored with --software\n");
+        shader_reload.Enabled = 0;
+        return;
+    }
+    shader_reload.Fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (shader_reload.Fd < 0) {
+        fprintf(stderr, "Error: inotify is not available for --watch-shaders\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&shader_reload.Lock, NULL);
+    shader_reload.Before = -1;
+    shader_reload_watch(main_program);
+    shader_reload_watch(static_scene.Program);
+    shader_reload_watch(text_renderer.Program);
+    shader_reload_watch(laser_renderer.Program);
+    shader_reload_watch(particles.Program);
+    if (resolution.Enabled)
+        shader_reload_watch(resolution.Program);
+}
+
+/* Note the files written since the last call. Main thread, never blocks.
+   Returns whether a reload is on its way, so frames keep being drawn. */
+int shader_reload_poll ()
+{
+    if (!shader_reload.Enabled)
+        return 0;
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    pthread_mutex_lock(&shader_reload.Lock);
+    while ((length = read(shader_reload.Fd, buffer, sizeof(buffer))) > 0) {
+        for (char* p = buffer; p < buffer + length; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len) {
+            struct inotify_event* event = (struct inotify_event*) p;
+            if (!event->len)
+                continue;
+            for (size_t w=0; w<shader_reload.watches.size(); w++)
+                if (shader_reload.watches[w] == event->wd)
+                    shader_reload.changed.push_back(shader_reload.watch_dirs[w] + event->name);
+        }
+    }
+    int busy = !shader_reload.changed.empty() || shader_reload.Busy;
+    pthread_mutex_unlock(&shader_reload.Lock);
+    return busy;
+}
+
+float shader_reload_average ()
+{
+    float sum = 0;
+    for (int i=0; i<shader_reload.TimeCount; i++)
+        sum += shader_reload.times[i];
+    return sum / shader_reload.TimeCount;
+}
+
+/* Start rebuilding what changed, swap in what is ready. Render thread, at a frame boundary. */
+void shader_reload_update ()
+{
+    if (!shader_reload.Enabled)
+        return;
+    vector<string> changed;
+    pthread_mutex_lock(&shader_reload.Lock);
+    changed.swap(shader_reload.changed);
+    pthread_mutex_unlock(&shader_reload.Lock);
+
+    int busy = 0;
+    for (size_t t=0; t<shader_reload.targets.size(); t++) {
+        ReloadTarget& target = shader_reload.targets[t];
+        ShaderProgram& live = *target.Live;
+        int stale = 0;
+        for (size_t c=0; c<changed.size(); c++)
+            stale |= changed[c] == live.VertexPath || changed[c] == live.FragmentPath;
+
+        if (stale) {
+            // Written again while compiling, the newest version wins
+            if (target.Building)
+                program_discard(target.Next);
+            program_start(target.Next, live.VertexPath, live.FragmentPath);
+            target.Building = 1;
+        }
+        if (target.Building && program_compiled(target.Next)) {
+            program_finish(target.Next);
+            target.Building = 0;
+            if (target.Next.Failed) {
+                fprintf(stderr, "Warning: %s + %s did not link, keeping the running program\n", live.VertexPath, live.FragmentPath);
+                program_discard(target.Next);
+                continue;
             }
-            if (action == GLFW_RELEASE)
-            {
-              mright_click=0;
+            GLuint old = live.ID;
+            live.ID = target.Next.ID;
+            if (live.Linked)
+                live.Linked(live.ID);
+            glDeleteProgram(old);
+
+            // Swaps before the report of the last one share its before time
+            string swapped = string(live.VertexPath) + " + " + live.FragmentPath;
+            printf("Shader reload: %s swapped in\n", swapped.c_str());
+            if (shader_reload.Before >= 0)
+                shader_reload.Swapped += ", " + swapped;
+            else if (shader_reload.TimeCount) {
+                shader_reload.Before = shader_reload_average();
+                shader_reload.Swapped = swapped;
             }
-            break;
-        default:
-            break;
+            shader_reload.TimeCount = shader_reload.TimeNext = 0;
+        }
+        busy += target.Building;
+    }
+
+    pthread_mutex_lock(&shader_reload.Lock);
+    shader_reload.Busy = busy;
+    pthread_mutex_unlock(&shader_reload.Lock);
+}
+
+/* Time of the frame just drawn, for the before and after report */
+void shader_reload_frame (float ms)
+{
+    if (!shader_reload.Enabled)
+        return;
+    shader_reload.times[shader_reload.TimeNext] = ms;
+    shader_reload.TimeNext = (shader_reload.TimeNext + 1) % RELOAD_WINDOW;
+    shader_reload.TimeCount = min(shader_reload.TimeCount + 1, RELOAD_WINDOW);
+    if (shader_reload.Before >= 0 && shader_reload.TimeCount == RELOAD_WINDOW) {
+        printf("Shader reload: %s, %.3f ms a frame before, %.3f ms after (%s)\n", shader_reload.Swapped.c_str(),
+               shader_reload.Before, shader_reload_average(), profiler.Enabled ? "GPU" : "render thread");
+        shader_reload.Before = -1;
+    }
+}
+
+/*****************
+ * Frame pacing  *
+ *****************/
+/* --pacing picks how frames are paced: vsync (the default), adaptive vsync
+   which tears rather than waits a whole refresh when a frame is late,
+   uncapped for benchmarks, or a number of Hz for a software limiter. The
+   limiter sleeps until just before each frame's deadline and spins for the
+   rest, which a sleep alone is too coarse for. Every mode keeps the time
+   between presented frames, and reports their average and jitter (standard
+   deviation) over the last PACING_WINDOW frames, and over the whole run. */
+#define PACING_WINDOW 120
+#define PACING_SPIN 0.002           // seconds before a deadline to stop sleeping
+
+enum PacingMode { PACING_VSYNC, PACING_ADAPTIVE, PACING_UNCAPPED, PACING_LIMIT };
+const char* pacing_names[] = {"vsync", "adaptive vsync", "uncapped", "limited"};
+
+struct FramePacing {
+    int Mode;
+    double Rate;                    // Hz, with PACING_LIMIT
+
+    // Render thread
+    double Deadline;                // of the next frame, with PACING_LIMIT
+    double LastPresent;
+    float intervals[PACING_WINDOW]; // ms between presented frames
+    int Count, Next;
+    double Sum, SumSquares, Max;    // of every interval, in ms
+    long Total;
+} pacing;
+
+/* Swap interval of the current context for the mode, main thread before the render thread starts */
+void pacing_swap_interval ()
+{
+    if (pacing.Mode == PACING_ADAPTIVE && !glfwExtensionSupported("GLX_EXT_swap_control_tear")
+        && !glfwExtensionSupported("WGL_EXT_swap_control_tear")) {
+        fprintf(stderr, "Warning: adaptive vsync is not supported, using vsync\n");
+        pacing.Mode = PACING_VSYNC;
+    }
+    glfwSwapInterval(pacing.Mode == PACING_VSYNC ? 1 : pacing.Mode == PACING_ADAPTIVE ? -1 : 0);
+}
+
+/* Hold the frame until its deadline, right before it is presented */
+void pacing_wait ()
+{
+    if (pacing.Mode != PACING_LIMIT)
+        return;
+    double period = 1.0/pacing.Rate, now = game_time();
+    pacing.Deadline += period;
+    if (pacing.Deadline < now - period)
+        pacing.Deadline = now;      // too far behind to catch up, start again from here
+    double sleep = pacing.Deadline - now - PACING_SPIN;
+    if (sleep > 0) {
+        struct timespec ts = {(time_t) sleep, (long) ((sleep - (time_t) sleep)*1e9)};
+        nanosleep(&ts, NULL);
     }
+    while (game_time() < pacing.Deadline);
 }
 
+/* Note the time a frame was presented at */
+void pacing_presented ()
+{
+    double now = game_time();
+    if (pacing.LastPresent) {
+        float ms = (now - pacing.LastPresent)*1000;
+        pacing.intervals[pacing.Next] = ms;
+        pacing.Next = (pacing.Next + 1) % PACING_WINDOW;
+        pacing.Count = min(pacing.Count + 1, PACING_WINDOW);
+        pacing.Sum += ms;
+        pacing.SumSquares += ms*ms;
+        pacing.Max = max(pacing.Max, (double) ms);
+        pacing.Total++;
+    }
+    pacing.LastPresent = now;
+}
 
-/* Executed when window is resized to 'width' and 'height' */
-/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
-void reshapeWindow (GLFWwindow* window, int width, int height)
+/* Average and jitter of the last PACING_WINDOW intervals */
+void pacing_window (float* mean, float* jitter)
 {
-    int fbwidth=width, fbheight=height;
-    /* With Retina display on Mac OS X, GLFW's FramebufferSize
-     is different from WindowSize */
-    glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+    float sum = 0, squares = 0;
+    for (int i=0; i<pacing.Count; i++) {
+        sum += pacing.intervals[i];
+        squares += pacing.intervals[i]*pacing.intervals[i];
+    }
+    *mean = pacing.Count ? sum/pacing.Count : 0;
+    *jitter = pacing.Count ? sqrt(max(0.0f, squares/pacing.Count - *mean * *mean)) : 0;
+}
 
-	GLfloat fov = 90.0f;
+/* Whole run summary, once the render thread is done */
+void pacing_finish ()
+{
+    if (!pacing.Total)
+        return;
+    double mean = pacing.Sum/pacing.Total;
+    double jitter = sqrt(max(0.0, pacing.SumSquares/pacing.Total - mean*mean));
+    printf("Pacing: %s", pacing_names[pacing.Mode]);
+    if (pacing.Mode == PACING_LIMIT)
+        printf(" to %.1f Hz", pacing.Rate);
+    printf(", %ld frames, %.3f ms average, %.3f ms jitter, %.3f ms longest\n", pacing.Total, mean, jitter, pacing.Max);
+}
 
-	// sets the viewport of openGL renderer
-	glViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
+/*****************
+ * Input latency *
+ *****************/
+/* Every key, button and scroll event, and every cursor move while a button
+   is held, is stamped with the time the game first learns of it. The
+   stamps ride along with the next recorded frame, and the render thread
+   takes them off once that frame is presented, so the latency includes
+   simulation, the frames queued ahead of it, drawing and the swap. Frames
+   left undrawn because nothing changed drop theirs. The distribution is
+   kept in LATENCY_BUCKET_MS wide buckets and summed up on exit.
+   --late-latch samples the cursor again right before the cannon and the
+   buckets are moved, instead of only at the start of draw(), so a drag
+   shows the newest position the frame can still use. */
+#define LATENCY_BUCKETS 200
+#define LATENCY_BUCKET_MS 0.5f
+
+struct InputLatency {
+    int LateLatch;
+
+    // Main thread
+    double CursorX, CursorY;    // last position seen, in window coordinates
+    vector<double> pending;     // times of the events the next frame is the first to show
+    long Unseen;                // events of frames that changed nothing
+
+    // Render thread
+    int buckets[LATENCY_BUCKETS];
+    long Count;
+    double Sum, Max;            // ms
+} input_latency;
+
+void input_event ()
+{
+    input_latency.pending.push_back(game_time());
+}
 
-	// set the projection matrix as perspective
-	/* glMatrixMode (GL_PROJECTION);
-	   glLoadIdentity ();
-	   gluPerspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1, 500.0); */
-	// Store the projection matrix in a variable for future use
-    // Perspective projection for 3D views
-    // Matrices.projection = glm::perspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1f, 500.0f);
+/* Cursor callback, only a drag moves anything */
+void cursor_moved (GLFWwindow* window, double x, double y)
+{
+    if ((mleft_click || mright_click) && (x != input_latency.CursorX || y != input_latency.CursorY))
+        input_event();
+    input_latency.CursorX = x;
+    input_latency.CursorY = y;
+}
 
-    // Ortho projection for 2D views (-x,+x,-y,+y)
-      Matrices.projection = glm::ortho((float)(-500.0f/zoom_camera+x_change), (float)(500.0f/zoom_camera+x_change), (float)(-350.0f/zoom_camera+y_change), (float)(350.0f/zoom_camera+y_change), 0.1f, 500.0f);
-  //  Matrices.projection = glm::ortho(-500.0f/zoom_camera, 500.0f/zoom_camera, -350.0f/zoom_camera, 350.0f/zoom_camera, 0.1f, 500.0f);
+/* Read the cursor into new_mouse_pos, in game coordinates */
+void latch_cursor (GLFWwindow* window)
+{
+    double x = input_latency.CursorX, y = input_latency.CursorY;
+    get_cursor_pos(window, &x, &y);
+    // Moved since the last callback, the callback for it will find it already seen
+    cursor_moved(window, x, y);
+    new_mouse_pos_x=x-500;
+    new_mouse_pos_y=y*-1+350;
+}
+
+/* The frame carrying these events was presented, render thread */
+void input_latency_presented (const vector<double>& events)
+{
+    for (size_t e=0; e<events.size(); e++) {
+        double ms = (pacing.LastPresent - events[e])*1000;
+        input_latency.buckets[min((int) (ms/LATENCY_BUCKET_MS), LATENCY_BUCKETS - 1)]++;
+        input_latency.Count++;
+        input_latency.Sum += ms;
+        input_latency.Max = max(input_latency.Max, ms);
+    }
 }
 
+/* Upper edge of the bucket the given fraction of events is within */
+float input_latency_percentile (float fraction)
+{
+    long seen = 0;
+    for (int b=0; b<LATENCY_BUCKETS - 1; b++) {
+        seen += input_latency.buckets[b];
+        if (seen >= fraction*input_latency.Count)
+            return min((b + 1)*LATENCY_BUCKET_MS, (float) input_latency.Max);
+    }
+    return input_latency.Max;
+}
 
-VAO* createLine (COLOR color,int x1,int y1,int x2,int y2)
+/* Whole run summary, once the render thread is done */
+void input_latency_finish ()
 {
-  /* ONLY vertices between the bounds specified in glm::ortho will be visible on screen */
+    if (!input_latency.Count)
+        return;
+    printf("Input latency: %ld events, %.2f ms average, 50%% within %.1f ms, 90%% within %.1f ms, "
+           "99%% within %.1f ms, longest %.2f ms%s\n", input_latency.Count, input_latency.Sum/input_latency.Count,
+           input_latency_percentile(0.5f), input_latency_percentile(0.9f), input_latency_percentile(0.99f),
+           input_latency.Max, input_latency.LateLatch ? ", late latching" : "");
+    if (input_latency.Unseen)
+        printf("Input latency: %ld more events changed nothing on screen\n", input_latency.Unseen);
+}
 
-  /* Define vertex array as used in glBegin (GL_TRIANGLES) */
-   GLfloat vertex_buffer_data [] = {
-    x1, y2,0, // vertex 0
-    (x1+x2)/2,(y1+y2)/2,0, // vertex 1
-    x2,y2,0, // vertex 2
-  };
+/*****************
+ * Render thread *
+ *****************/
+/* The render thread owns the GL context and draws the frames draw()
+   records, so a slow swap or a driver stall no longer holds up the game
+   logic, and simulation and rendering overlap on multi-core machines.
+   Frames go through a ring of RENDER_FRAMES: one being drawn and up to two
+   queued. The simulation only waits when all of them are taken, which
+   also keeps the game at the display rate as before. --no-render-thread
+   draws each frame as soon as it is recorded, on the main thread. */
+#define RENDER_FRAMES 3
+
+struct RenderFrame {
+    vector<RenderCommand> commands;
+    vector<BrickInstance> bricks;
+    vector<glm::mat4> scene_matrices;
+    vector<DrawElementsIndirectCommand> scene_commands;
+    vector<TextGlyph> glyphs;
+    vector<LaserInstance> lasers;
+    ParticleArrays particles;
+    vector<double> inputs;      // input events this frame is the first to show
+    int Width, Height;          // of the output, see reshapeWindow()
+    double CPUTime;             // simulation time spent recording it
+};
 
-   GLfloat color_buffer_data [] = {
-    color.r,color.g,color.b, // color 0
-    color.r,color.g,color.b, // color 1
-    color.r,color.g,color.b, // color 2
-  };
+struct RenderStats {            // of the last frame drawn
+    int DrawCalls;
+    int StateIssued, StateFiltered;
+    float CPU, GPU;             // profiler times, when profiling
+    float Scale;                // of the frame's sides, with --dynamic-resolution
+    float FrameMS, Jitter;      // between presented frames, see pacing_window()
+};
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  return create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
+struct RenderThread {
+    int Enabled;
+    int Running;
+    GLFWwindow* Window;
+    pthread_t Thread;
+    pthread_mutex_t Lock;
+    pthread_cond_t Queued;      // a frame was queued, or the thread is stopping
+    pthread_cond_t Done;        // a frame was drawn and its slot is free
+    RenderFrame frames[RENDER_FRAMES];
+    vector<int> queue;          // frames waiting to be drawn, oldest first
+    vector<int> free_frames;
+    int Stopping;
+    RenderStats stats;
+} render_thread = {1};
+
+/* Give the context to the calling thread, or let go of it */
+void render_make_current (int current)
+{
+    if (software.Enabled)
+        return;
+    if (headless.Enabled)
+        eglMakeCurrent(headless.Display, EGL_NO_SURFACE, EGL_NO_SURFACE, current ? headless.Context : EGL_NO_CONTEXT);
+    else
+        glfwMakeContextCurrent(current ? render_thread.Window : NULL);
 }
 
-
-// Creates the triangle object used in this sample code
-VAO* createTriangle ()
+/* Replay a recorded frame and present it */
+RenderStats render_frame (const RenderFrame& frame)
 {
-  /* ONLY vertices between the bounds specified in glm::ortho will be visible on screen */
+    double start = game_time();
+    shader_reload_update();
+    profiler_begin_frame();
+    resolution_begin_frame(frame.Width, frame.Height);
+    sprite_batch.DrawCalls = 0;
+
+    // clear the color and depth in the frame buffer
+    // The background cache covers the whole frame, there is nothing to clear under it
+    if (software.Enabled)
+        sw_clear();
+    else {
+        if (frame.commands.empty() || frame.commands[0].Type != RENDER_BACKGROUND)
+            glClear (GL_COLOR_BUFFER_BIT);
+        program_use (main_program);
+    }
 
-  /* Define vertex array as used in glBegin (GL_TRIANGLES) */
-  GLfloat vertex_buffer_data [] = {
-    0, 0,0, // vertex 0
-    4.0,4.0,0, // vertex 1
-    -4,-4,0, // vertex 2
-  };
+    for (size_t c=0; c<frame.commands.size(); c++) {
+        const RenderCommand& cmd = frame.commands[c];
+        if (cmd.Key >> 56 == LAYER_HUD)
+            resolution_present();
+        if (cmd.Pass >= 0)
+            profile_begin(cmd.Pass);
+        switch (cmd.Type) {
+            case RENDER_BRICKS:
+                brick_renderer_execute(&frame.bricks[cmd.First], cmd.Count, cmd.VP);
+                break;
+            case RENDER_STATIC_SCENE:
+                static_scene_execute(frame.scene_matrices, frame.scene_commands, cmd.VP, cmd.First, background.Enabled ? 0 : -1);
+                break;
+            case RENDER_BACKGROUND:
+                background_execute(frame.scene_matrices, frame.scene_commands, cmd.VP);
+                break;
+            case RENDER_TEXT:
+                text_execute(&frame.glyphs[cmd.First], cmd.Count, cmd.VP);
+                break;
+            case RENDER_LASERS:
+                laser_execute(&frame.lasers[cmd.First], cmd.Count, cmd.VP);
+                break;
+            case RENDER_PARTICLES:
+                particles_execute(frame.particles, cmd.Count, cmd.VP);
+                break;
+        }
+        if (cmd.Pass >= 0)
+            profile_end();
+    }
 
-  GLfloat color_buffer_data [] = {
-    1,0,0, // color 0
-    0,1,0, // color 1
-    0,0,1, // color 2
-  };
+    resolution_present();
+    profiler_end_frame(frame.CPUTime);
+    profiler_draw_overlay();
+    resolution_end_frame();
+
+    RenderStats stats = {sprite_batch.DrawCalls, gl_state.Issued, gl_state.Filtered, profiler.LastCPU, profiler.LastGPU, resolution.Scale, 0, 0};
+    state_cache_end_frame();
+    stream_end_frame();
+    shader_reload_frame(profiler.Enabled ? profiler.LastGPU : (float) ((game_time() - start) * 1000));
+    if (capture.Enabled)
+        capture_frame();
+
+    pacing_wait();
+    if (headless.Enabled)
+        headless_end_frame();
+    else {
+        // Swap Frame Buffer in double buffering
+        glfwSwapBuffers(render_thread.Window);
+    }
+    pacing_presented();
+    input_latency_presented(frame.inputs);
+    pacing_window(&stats.FrameMS, &stats.Jitter);
+    return stats;
+}
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  return create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
+void* render_thread_main (void*)
+{
+    render_make_current(1);
+    pthread_mutex_lock(&render_thread.Lock);
+    while (true) {
+        while (render_thread.queue.empty() && !render_thread.Stopping)
+            pthread_cond_wait(&render_thread.Queued, &render_thread.Lock);
+        if (render_thread.queue.empty())
+            break;
+        int slot = render_thread.queue.front();
+        render_thread.queue.erase(render_thread.queue.begin());
+        pthread_mutex_unlock(&render_thread.Lock);
+
+        RenderStats stats = render_frame(render_thread.frames[slot]);
+
+        pthread_mutex_lock(&render_thread.Lock);
+        render_thread.stats = stats;
+        render_thread.free_frames.push_back(slot);
+        pthread_cond_signal(&render_thread.Done);
+    }
+    pthread_mutex_unlock(&render_thread.Lock);
+    render_make_current(0);
+    return NULL;
 }
 
+/* Hand the GL context over to a new render thread, once everything is created */
+void render_thread_start (GLFWwindow* window)
+{
+    render_thread.Window = window;
+    pthread_mutex_init(&render_thread.Lock, NULL);
+    pthread_cond_init(&render_thread.Queued, NULL);
+    pthread_cond_init(&render_thread.Done, NULL);
+    for (int i=0; i<RENDER_FRAMES; i++)
+        render_thread.free_frames.push_back(i);
+
+    if (!render_thread.Enabled)
+        return;
+    render_make_current(0);
+    pthread_create(&render_thread.Thread, NULL, render_thread_main, NULL);
+    render_thread.Running = 1;
+}
 
-// Creates the rectangle object used in this sample code
-VAO* createRectangle (COLOR color1, float height, float width)
+/* Let the render thread draw what is queued, then take the context back */
+void render_thread_stop ()
 {
-  // GL3 accepts only Triangles. Quads are not supported
-  float w=width/2,h=height/2;
-  GLfloat vertex_buffer_data [] = {
-      -w,-h,0, // vertex 1
-      -w,h,0, // vertex 2
-      w,h,0, // vertex 3
+    if (!render_thread.Running)
+        return;
+    pthread_mutex_lock(&render_thread.Lock);
+    render_thread.Stopping = 1;
+    pthread_cond_signal(&render_thread.Queued);
+    pthread_mutex_unlock(&render_thread.Lock);
+    pthread_join(render_thread.Thread, NULL);
+    render_thread.Running = 0;
+    render_make_current(1);
+}
 
-      w,h,0, // vertex 3
-      w,-h,0, // vertex 4
-      -w,-h,0  // vertex 1
-  };
+/* Drop the recorded frame, ready to record the next one */
+void render_discard ()
+{
+    render_commands.clear();
+    brick_renderer.instances.clear();
+    brick_renderer.Recorded = 0;
+    text_renderer.glyphs.clear();
+    text_renderer.Recorded = 0;
+    laser_renderer.instances.clear();
+    laser_renderer.Recorded = 0;
+    input_latency.Unseen += input_latency.pending.size();
+    input_latency.pending.clear();
+}
 
-   GLfloat color_buffer_data [] = {
-    color1.r,color1.g,color1.b, // color 1
-    color1.r,color1.g,color1.b, // color 2
-    color1.r,color1.g,color1.b, // color 3
+/* Move the recorded frame into a free slot and queue it for drawing */
+void render_submit (double cpu_time)
+{
+    pthread_mutex_lock(&render_thread.Lock);
+    while (render_thread.free_frames.empty())
+        pthread_cond_wait(&render_thread.Done, &render_thread.Lock);
+    int slot = render_thread.free_frames.back();
+    render_thread.free_frames.pop_back();
+    pthread_mutex_unlock(&render_thread.Lock);
+
+    // Swapped rather than copied, the recording lists get the slot's old storage back
+    RenderFrame& frame = render_thread.frames[slot];
+    render_sort(render_commands);
+    frame.commands.swap(render_commands);
+    frame.bricks.swap(brick_renderer.instances);
+    frame.glyphs.swap(text_renderer.glyphs);
+    frame.lasers.swap(laser_renderer.instances);
+    frame.particles = particles.live;
+    frame.inputs.swap(input_latency.pending);
+    input_latency.pending.clear();
+    frame.Width = resolution.Width;
+    frame.Height = resolution.Height;
+    frame.scene_matrices = static_scene.matrices;
+    frame.scene_commands = static_scene.commands;
+    frame.CPUTime = cpu_time;
+    render_discard();
+
+    if (!render_thread.Running) {
+        RenderStats stats = render_frame(frame);
+        pthread_mutex_lock(&render_thread.Lock);
+        render_thread.stats = stats;
+        render_thread.free_frames.push_back(slot);
+        pthread_mutex_unlock(&render_thread.Lock);
+        return;
+    }
 
-    color1.r,color1.g,color1.b, // color 3
-    color1.r,color1.g,color1.b, // color 4
-    color1.r,color1.g,color1.b,  // color 1
+    pthread_mutex_lock(&render_thread.Lock);
+    render_thread.queue.push_back(slot);
+    pthread_cond_signal(&render_thread.Queued);
+    pthread_mutex_unlock(&render_thread.Lock);
+}
 
-  };
+RenderStats render_stats ()
+{
+    pthread_mutex_lock(&render_thread.Lock);
+    RenderStats stats = render_thread.stats;
+    pthread_mutex_unlock(&render_thread.Lock);
+    return stats;
+}
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
+/*****************
+ * Idle redraws  *
+ *****************/
+/* A frame is only drawn when something visible changed. The recorded frame
+   is the complete description of the picture (sprites, bricks, scene
+   matrices, HUD text and the camera VP), so it is compared with the one last drawn.
+   Unchanged frames skip the clear, the draws and the swap, and the front
+   buffer keeps showing the last one. An idle window then blocks in
+   glfwWaitEventsTimeout() until input or the next brick spawn, and an
+   iconified one is not drawn at all. --always-redraw turns it off, and so
+   do the modes that need every frame: headless, capture and profiling. */
+struct Redraw {
+    int Enabled;
+    int Force;                  // the window must be repainted, changed or not
+    int Hidden;                 // iconified, the game goes on undrawn
+    double Interval;            // one refresh of the display
+    RenderFrame last;           // what the last frame drawn showed
+    int Drawn, Skipped;         // frames since the last show_stats()
+    int LastDrawn, LastSkipped;
+} redraw = {1, 1, 0, 1.0/60};
+
+void window_refresh (GLFWwindow* window)
+{
+    redraw.Force = 1;
+}
 
-    return create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+void redraw_init (GLFWwindow* window)
+{
+    if (headless.Enabled || capture.Enabled || profiler.Enabled)
+        redraw.Enabled = 0;
+    if (!window)
+        return;
+    GLFWmonitor* monitor = glfwGetPrimaryMonitor();
+    const GLFWvidmode* mode = monitor ? glfwGetVideoMode(monitor) : NULL;
+    if (mode && mode->refreshRate > 0)
+        redraw.Interval = 1.0/mode->refreshRate;
+    glfwSetWindowRefreshCallback(window, window_refresh);
 }
 
-float camera_rotation_angle = 90;
-float rectangle_rotation = 0;
-float triangle_rotation = 0;
-void reset_brick(int i)
+bool operator== (const RenderCommand& a, const RenderCommand& b)
 {
-  brick[i].status=0;
-  brick[i].y=350+brick[i].height/2;
-  brick[i].dx=0;
-  brick[i].dy=0;
+    return a.Type == b.Type && a.First == b.First && a.Count == b.Count
+        && a.Pass == b.Pass && a.Key == b.Key && memcmp(&a.VP, &b.VP, sizeof(a.VP)) == 0;
 }
-void create_bricks(COLOR color1,int no,float x_co)
+
+/* memcmp for vectors of padding free structs */
+template <class T> bool same_bytes (const vector<T>& a, const vector<T>& b)
 {
-  brick[no].color=color1;
-  brick[no].width=25;
-  brick[no].height=50;
-  brick[no].object = createRectangle (color1, brick[no].height,brick[no].width);
-  brick[no].x=x_co;//-380
-  brick[no].y=350+brick[no].height/2;
-  brick[no].dx=0;
-  brick[no].dy=0;
-  brick[no].status=0;
+    return a.size() == b.size() && (a.empty() || memcmp(&a[0], &b[0], a.size()*sizeof(T)) == 0);
 }
 
-void display(Sprite obj,glm::mat4 VP)
+/* Does the frame just recorded need drawing? Remembers it when it does. */
+int redraw_needed (GLFWwindow* window)
 {
-  glm::mat4 MVP;
-  Matrices.model = glm::mat4(1.0f);
-  //MVP = VP * Matrices.model; // MVP = p * V * M
-  glm::mat4 ObjectTransform;
-  glm::mat4 translateObject = glm::translate (glm::vec3(obj.x,obj.y, 0.0f)); // glTranslatef
-  glm::mat4  rotateTriangle=glm::mat4(1.0f);
-  if(obj.name=="mirror1" || obj.name=="mirror2" || obj.name=="mirror3" || obj.name=="mirror4" || obj.name=="sboard")
-  {
-   rotateTriangle = glm::rotate((float)(obj.rot_angle*M_PI/180.0f), glm::vec3(0,0,1));  // rotate about vector (1,0,0)
-  }
-  if(obj.name=="gun")
-  {
-    rotateTriangle = glm::rotate((float)(cannon["front"].rot_angle*M_PI/180.0f), glm::vec3(0,0,1));
-  }
-  ObjectTransform=translateObject *rotateTriangle;
-  if(obj.name=="lazer")
-  {
-    translateObject = glm::translate (glm::vec3(obj.x,obj.y, 0.0f)); // glTranslatef
-    rotateTriangle = glm::rotate((float)(obj.rot_angle*M_PI/180.0f), glm::vec3(0,0,1));
-    ObjectTransform=translateObject * rotateTriangle;
-  }
+    if (!redraw.Enabled)
+        return 1;
+    redraw.Hidden = window && glfwGetWindowAttrib(window, GLFW_ICONIFIED);
+    if (redraw.Hidden) {
+        redraw.Force = 1;       // repaint once restored
+        return 0;
+    }
 
-  Matrices.model *= ObjectTransform;
-  MVP = VP * Matrices.model; // MVP = p * V * M
+    // Hidden objects keep stale matrices, only the visible ones are compared
+    int changed = redraw.Force || render_commands != redraw.last.commands
+        || resolution.Width != redraw.last.Width || resolution.Height != redraw.last.Height
+        || !same_bytes(brick_renderer.instances, redraw.last.bricks)
+        || !same_bytes(text_renderer.glyphs, redraw.last.glyphs)
+        || !same_bytes(laser_renderer.instances, redraw.last.lasers)
+        || !particles.live.x.empty()  // they never stand still
+        || !same_bytes(static_scene.commands, redraw.last.scene_commands);
+    for (size_t c=0; c<static_scene.commands.size() && !changed; c++) {
+        GLuint id = static_scene.commands[c].baseInstance;
+        if (static_scene.commands[c].instanceCount)
+            changed = memcmp(&static_scene.matrices[id], &redraw.last.scene_matrices[id], sizeof(glm::mat4)) != 0;
+    }
+    if (!changed)
+        return 0;
+
+    redraw.Force = 0;
+    redraw.last.commands = render_commands;
+    redraw.last.bricks = brick_renderer.instances;
+    redraw.last.glyphs = text_renderer.glyphs;
+    redraw.last.lasers = laser_renderer.instances;
+    redraw.last.Width = resolution.Width;
+    redraw.last.Height = resolution.Height;
+    redraw.last.scene_commands = static_scene.commands;
+    redraw.last.scene_matrices = static_scene.matrices;
+    return 1;
+}
 
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(obj.object);
+/* How long an idle window can wait for events: nothing moves before the next
+   brick spawn. A hidden one still runs the game at the display rate. */
+double redraw_wait ()
+{
+    if (redraw.Hidden)
+        return redraw.Interval;
+    double spawn = old_time + 1 - game_time();
+    return max(redraw.Interval, min(spawn, 0.5));
 }
 
+
 int flag=1;
 int i=10,arr[101]={0},it=0;
 void display_brick(glm::mat4 VP,GLFWwindow* window)
 {
   int rand1;
-  current_time=glfwGetTime();
+  current_time=game_time();
   if(current_time-old_time>1)
   {
-    rand1=rand()%100;
+    rand1=rand()%num_bricks;
     if(brick[rand1].status==0)
       brick[rand1].status=1;
     old_time=current_time;
   }
-    for(int k=0; k<100 ; k++)
+    for(int k=0; k<num_bricks ; k++)
     {
       if(brick[k].status==1)
       {
-        display(brick[k],VP);
+        brick_renderer_add(brick[k]);
         if(brick[k].y>partition+brick[k].height/2)
           brick[k].y+=brick_speed;
         else
@@ -741,14 +4354,12 @@ void display_brick(glm::mat4 VP,GLFWwindow* window)
           if(match_color(brick[k].color,black))
           if(brick[k].x>bucket["green"].x-bucket["green"].width/2 && brick[k].x<bucket["green"].x+bucket["green"].width/2
           || (brick[k].x>bucket["red"].x-bucket["red"].width/2 && brick[k].x<bucket["red"].x+bucket["red"].width/2) )
-          {
-            cout<<"Final score is: "<<score<<endl;
-            cout<<"Game Over\n";
-            quit(window);
-          }
+            game_over();
         }
       }
     }
+
+  brick_renderer_draw(VP);
 }
 void display_buckets(glm::mat4 VP,GLFWwindow* window)
 {
@@ -778,15 +4389,15 @@ void display_buckets(glm::mat4 VP,GLFWwindow* window)
     }
   }
 
-  display(bucket["green"],VP);
-  display(bucket["red"],VP);
+  static_scene_update(bucket["green"]);
+  static_scene_update(bucket["red"]);
 }
 /* Edit this function according to your assignment */
 long long st1=0,st2=0;
 void detect_collision(GLFWwindow* window)
 {
   long long li,bi;
-  float temp=glfwGetTime();
+  float temp=game_time();
   float dis,dis1,dis2;
   //if(current_time-temp>5)
   //st1++;mis_hit<<
@@ -794,7 +4405,7 @@ void detect_collision(GLFWwindow* window)
     {
       Sprite lobj=lazer[li],bobj;
       if(lobj.status==1)
-      for(bi=0;bi<100;bi++)
+      for(bi=0;bi<num_bricks;bi++)
       {
         bobj=brick[bi];
         if(bobj.status==1)
@@ -813,16 +4424,12 @@ void detect_collision(GLFWwindow* window)
               {
                 score-=1;
                 mis_hit--;
-                cout<<"miss hits remaining: "<<mis_hit<<endl;
                 // cout<<"Score: "<<score<<endl;
                 if(mis_hit==0)
-                {
-                  cout<<"Final score is: "<<score<<endl;
-                  cout<<"Game Over\n";
-                  quit(window);
-                }
+                  game_over();
               }
             lazer[li].status=0;
+            particles_burst(bobj.x, bobj.y, bobj.color, PARTICLE_BURST);
             reset_brick(bi);
           }
         }
@@ -862,7 +4469,7 @@ void check_mirror_col(int li)
           //       (mir.y+mir.width/2*sin(mir.rot_angle*M_PI/180))-(tan(mir.rot_angle*M_PI/180)*(mir.x+mir.width/2)*cos(mir.rot_angle*M_PI/180));
           // if(mul1*mul2<=0)
           // if(lazmir[li][0]==0 || lazmir[current][1]==0)
-          current_time=glfwGetTime();
+          current_time=game_time();
           // cout << "collide mirror" << endl;
           if(current_time-m_col_time>0.1)
           {
@@ -877,65 +4484,21 @@ void check_mirror_col(int li)
 
 void check_score(GLFWwindow* window)
 {
+  // The score itself is on the HUD, see draw_hud()
+  const char* message=NULL;
   if(score==99)
-  {
-    cout<<"Congratulations! \n You Win\n";
-  }
+    message="Congratulations! You Win";
   if(score==-99)
-  {
-    cout<<"Oops! \n You Lose\n";
-  }
-  int o,t,nf=0;
-  for(i=1;i<=15;i++)
-    sboard[i].status=0;
-  if(score<0)
-    {
-      sboard[15].status=1;
-      score*=-1;
-    }
-  o=score%10;
-  t=score/10;
-  if(sboard[15].status)
-    score*=-1;
-  if(o==0 || o==2 || o==3 || o==5 || o==6 || o==7 || o==8 || o==9)
-    sboard[1].status=1;
-  if(o==0 || o==1 || o==2 || o==3 || o==4 || o==7 || o==8 || o==9)
-    sboard[2].status=1;
-  if(o==0 || o==1 || o==3 || o==4 || o==5 || o==6 || o==7 || o==8 || o==9)
-    sboard[3].status=1;
-  if(o==0 ||o==2 || o==3 || o==5 || o==6 || o==8 || o==9)
-    sboard[4].status=1;
-  if(o==0 || o==2 || o==6 || o==8)
-    sboard[5].status=1;
-  if(o==0  || o==4 || o==5 || o==6 || o==8 || o==9)
-    sboard[6].status=1;
-  if( o==2 || o==3 || o==4 || o==5 || o==6 || o==8 || o==9 )
-    sboard[7].status=1;
-  if(t==0 || t==2 || t==3 || t==5 || t==6 || t==7 || t==8 || t==9)
-    sboard[8].status=1;
-  if(t==0 || t==1 || t==2 || t==3 || t==4 || t==7 || t==8 || t==9)
-    sboard[9].status=1;
-  if(t==0 || t==1 || t==3 || t==4 || t==5 || t==6 || t==7 || t==8 || t==9)
-    sboard[10].status=1;
-  if(t==0 ||t==2 || t==3 || t==5 || t==6 || t==8 || t==9)
-    sboard[11].status=1;
-  if(t==0 || t==2 || t==6 || t==8)
-    sboard[12].status=1;
-  if(t==0 || t==4 || t==5 || t==6 || t==8 || t==9)
-    sboard[13].status=1;
-  if( t==2 || t==3 || t==4 || t==5 || t==6 || t==8 || t==9 )
-    sboard[14].status=1;
+    message="Oops! You Lose";
+  if(message && message!=hud.Message)
+    cout<<message<<endl;
+  hud.Message=message;
 }
 
 void draw (GLFWwindow* window){
-  // clear the color and depth in the frame buffer
-  glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
+  // Simulates and records the frame, render_frame() does the clearing and drawing
 
 /* don't disturb anything */
-  // use the loaded shader program
-  // Don't change unless you know what you are doing
-  glUseProgram (programID);
 
   // Eye - Location of camera. Don't change unless you are sure!!
   glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
@@ -963,26 +4526,21 @@ void draw (GLFWwindow* window){
 // glUniformMatrix4fv always used before calling draw function
 //  Don't change unless you are sure!!
 
-  // Load identity to model matrix
-  Matrices.model = glm::mat4(1.0f);
-  MVP = VP * Matrices.model; // MVP = p * V * M
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(objects["mainline"].object);
+  cull_begin(VP);
+
+  static_scene_begin();
+  static_scene_update(objects["mainline"]);
   if(mleft_click || mright_click)
-  {
-    glfwGetCursorPos(window, &new_mouse_pos_x, &new_mouse_pos_y);
-    new_mouse_pos_x=new_mouse_pos_x-500;
-    new_mouse_pos_y=new_mouse_pos_y*-1+350;
-  }
+    latch_cursor(window);
   if(mright_click==1)
   {
-    glfwGetCursorPos(window, &new_mouse_pos_x, &new_mouse_pos_y);
+    get_cursor_pos(window, &new_mouse_pos_x, &new_mouse_pos_y);
       x_change+=new_mouse_pos_x-mouse_pos_x;
       y_change-=new_mouse_pos_y-mouse_pos_y;
       check_pan();
   }
   Matrices.projection = glm::ortho((-500.0f/zoom_camera+x_change), (500.0f/zoom_camera+x_change), (-350.0f/zoom_camera+y_change),(350.0f/zoom_camera+y_change), 0.1f, 500.0f);
-  glfwGetCursorPos(window, &mouse_pos_x, &mouse_pos_y);
+  get_cursor_pos(window, &mouse_pos_x, &mouse_pos_y);
 
   detect_collision(window);
   // cout<<current_time<<" "<<m_col_time<<endl;
@@ -997,6 +4555,8 @@ void draw (GLFWwindow* window){
   { cannon["main"].y+=cannon["main"].dy;
     cannon["front"].y+=cannon["main"].dy;
   }
+  if(input_latency.LateLatch && mleft_click)
+    latch_cursor(window);
   if(move=="cmain" && mleft_click==1)
   {
     if(new_mouse_pos_y<(350-cannon["main"].width/2-1) &&
@@ -1017,8 +4577,11 @@ void draw (GLFWwindow* window){
     {
       lazer[i].status=0;
     }
-    display(lazer[i],VP);
+    laser_add(lazer[i]);
   }
+  laser_draw(VP);
+  particles_update();
+  particles_draw(VP);
   if(cannon["front"].key_press)
   {
     if(cannon["front"].key_press==1 && cannon["front"].rot_angle+degree_per_rotation<89)
@@ -1027,23 +4590,25 @@ void draw (GLFWwindow* window){
       cannon["front"].rot_angle-=degree_per_rotation;
 
   }
-  display(cannon["main"],VP);
-  display(cannon["front"],VP);
+  static_scene_update(cannon["main"]);
+  static_scene_update(cannon["front"]);
   //if(bucket["red"].key_press==1 || bucket["green"].key_press==1)
+  if(input_latency.LateLatch && mleft_click)
+    latch_cursor(window);
   display_buckets(VP,window);
   display_brick(VP,window);
-  display(mirror[1],VP);
-  display(mirror[3],VP);
-  display(mirror[2],VP);
-  display(mirror[4],VP);
+  static_scene_update(mirror[1]);
+  static_scene_update(mirror[3]);
+  static_scene_update(mirror[2]);
+  static_scene_update(mirror[4]);
   // score=-88;
   check_score(window);
-  for(int i=1;i<=15;i++)
-  {
-   if(sboard[i].status)
-      display(sboard[i],VP);
-  }
   //cout<<score<<endl;
+
+  // Send the fixed scene and the HUD, the background cache goes under everything
+  static_scene_draw(VP, background.Enabled);
+  background_draw(VP);
+  draw_hud();
 }
 
 /* Initialise glfw window, I/O callbacks and the renderer to use */
@@ -1071,11 +4636,12 @@ GLFWwindow* initGLFW (int width, int height)
 
     glfwMakeContextCurrent(window);
     gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
-    glfwSwapInterval( 1 );
+    pacing_swap_interval();
 
     /* --- register callbacks with GLFW --- */
 
-    /* Register function to handle window resi  if(no==1)
+    /* Register function to handle window resize */
+    glfwSetFramebufferSizeCallback(window, reshapeWindow);
 
     /* Register function to handle window close */
     glfwSetWindowCloseCallback(window, quit);
@@ -1086,6 +4652,7 @@ GLFWwindow* initGLFW (int width, int height)
 
     /* Register function to handle mouse click */
     glfwSetMouseButtonCallback(window, mouseButton);  // mouse button clicks
+    glfwSetCursorPosCallback(window, cursor_moved);   // drags, for input latency
     glfwSetScrollCallback(window, mousescroll); // mouse scroll
 
     return window;
@@ -1146,7 +4713,7 @@ void create_lazer(int no)
   lazer[no].color=lightblue;
   lazer[no].width=100;
   lazer[no].height=5;
-  lazer[no].object = createRectangle (lightblue, lazer[no].height,lazer[no].width);
+  lazer[no].object = NULL; // drawn by laser_renderer, no geometry of its own
   lazer[no].x=cannon["front"].x;
   lazer[no].y=cannon["front"].y;
   lazer[no].rot_angle=cannon["front"].rot_angle;
@@ -1165,7 +4732,7 @@ void brick_initializer()
     if(i<4)
       brick_col[i]=-300+i*60;
   }
-  for (int i = 0; i < 100; i++)
+  for (int i = 0; i < num_bricks; i++)
   {
     r1=rand()%9;
     r2=rand()%3;
@@ -1225,144 +4792,170 @@ void create_mirror()
   mirror[4].dy=0;
 }
 
-void create_board(int no)
-{
-  sboard[no].name="sboard";
-  sboard[no].color=black;
-  sboard[no].width=3;
-  sboard[no].height=50;
-  sboard[no].status=0;
-  sboard[no].rot_angle=0;
-  if(no==1)
-  {
-    sboard[no].rot_angle=90;
-    sboard[no].height=35;
-    sboard[no].x=478;
-    sboard[no].y=345;
-  }
-  if(no==2)
-  {
-    // sboard[no].rot_angle=0;
-    sboard[no].x=495;
-    sboard[no].y=323;
-  }
-  if(no==3)
-  {
-    sboard[no].x=495;
-    sboard[no].y=268;
-  }
-  if(no==4)
-  {
-    sboard[no].rot_angle=90;
-    sboard[no].height=35;
-    sboard[no].x=478;
-    sboard[no].y=240;
-  }
-  if(no==5)
-  {
-    sboard[no].x=460;
-    sboard[no].y=268;
-  }
-  if(no==6)
-  {
-    sboard[no].x=460;
-    sboard[no].y=323;
-  }
-  if(no==7)
-  {
-    sboard[no].rot_angle=90;
-    sboard[no].height=35;
-    sboard[no].x=478;
-    sboard[no].y=295;
-  }
-  if(no==8)
-  {
-    sboard[no].rot_angle=90;
-    sboard[no].height=35;
-    sboard[no].x=428;
-    sboard[no].y=345;
-  }
-  if(no==9)
-  {
-    // sboard[no].rot_angle=0;
-    sboard[no].x=445;
-    sboard[no].y=323;
-  }
-  if(no==10)
-  {
-    sboard[no].x=445;
-    sboard[no].y=268;
-  }
-  if(no==11)
-  {
-    sboard[no].rot_angle=90;
-    sboard[no].height=35;
-    sboard[no].x=428;
-    sboard[no].y=240;
-  }
-  if(no==12)
-  {
-    sboard[no].x=410;
-    sboard[no].y=268;
-  }
-  if(no==13)
-  {
-    sboard[no].x=410;
-    sboard[no].y=323;
-  }
-  if(no==14)
-  {
-    sboard[no].rot_angle=90;
-    sboard[no].height=35;
-    sboard[no].x=428;
-    sboard[no].y=295;
-  }
-  if(no==15)
-  {
-    sboard[no].rot_angle=90;
-    sboard[no].height=20;
-    sboard[no].x=388;
-    sboard[no].y=293;
-  }
-  sboard[no].object = createRectangle (black, sboard[no].height,sboard[no].width);
-}
-
 /* Initialize the OpenGL rendering properties */
 /* Add all the models to be created here */
 void initGL (GLFWwindow* window, int width, int height)
 {
-    /* Objects should be created before any other gl function and shaders */
-	// Create the models
+	// Programs go first, the driver compiles them while everything else is set up
+	if (!software.Enabled) {
+	  shader_compiler_init();
+	  program_start(main_program, "Sample_GL.vert", "Sample_GL.frag", main_program_linked);
+	}
+	static_scene_init();
+	text_init();
+	laser_init();
+	particles_init();
+	background_init();
+	resolution_init();
+	stream_init();
+
+	// Create the models, they reach the GPU when first drawn
   create_bucket("red");
   create_bucket("green");
   create_cannon();
   create_mirror();
   brick_initializer();
-  for(int i=1;i<=15;i++)
-    create_board(i);
 
   objects["mainline"].object=createLine(black,-500,partition,500,partition); // Generate the VAO, VBOs, vertices data & copy into the array buffer
 
 /* No change beyond this is allowed */
-	// Create and compile our GLSL program from the shaders
-	programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
-	// Get a handle for our "MVP" uniform
-	Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+	sprite_batch_init();
+	brick_renderer_init();
+	reset_instance_attributes();
+
+	static_scene_add(objects["mainline"], PASS_MAINLINE, LAYER_MAINLINE, 1);
+	static_scene_add(cannon["main"], PASS_CANNON, LAYER_CANNON);
+	static_scene_add(cannon["front"], PASS_CANNON, LAYER_CANNON);
+	static_scene_add(bucket["red"], PASS_BUCKETS, LAYER_CANNON);
+	static_scene_add(bucket["green"], PASS_BUCKETS, LAYER_CANNON);
+	for(int i=1;i<=4;i++)
+	  static_scene_add(mirror[i], PASS_MIRRORS, LAYER_MIRRORS, 1);
+	static_scene_build();
+	if (profiler.Enabled)
+	  profiler_init();
 
 
 	reshapeWindow (window, width, height);
 
+	if (software.Enabled) {
+	  cout << "RENDERER: software rasterizer" << endl;
+	  return;
+	}
+
     // Background color of the scene
 	glClearColor (255, 255, 255, 0.0f); // R, G, B, A
-	glClearDepth (1.0f);
 
-	glEnable (GL_DEPTH_TEST);
-	glDepthFunc (GL_LEQUAL);
+	// Everything is at z=0, the sort keys order the layers (see render_key())
+	glDisable (GL_DEPTH_TEST);
 
     cout << "VENDOR: " << glGetString(GL_VENDOR) << endl;
     cout << "RENDERER: " << glGetString(GL_RENDERER) << endl;
     cout << "VERSION: " << glGetString(GL_VERSION) << endl;
     cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
+    printf("Shaders: %d programs submitted in %.1f ms, %d from the program cache%s, %s compile\n",
+           shader_compiler.Started, shader_compiler.SubmitTime*1e3, program_cache.Hits,
+           program_cache_usable() ? "" : " (not available)", shader_compiler.Parallel ? "parallel" : "serial");
+}
+
+/* Renderer counters of the last frame, shown in the title bar and on the HUD */
+void show_stats (GLFWwindow* window, double elapsed)
+{
+    char title[256], debug[128];
+    RenderStats stats = render_stats();
+    snprintf(debug, sizeof(debug), "%.0f fps, %.2f +- %.2f ms | %d draws | culled %d of %d",
+             redraw.LastDrawn/elapsed, stats.FrameMS, stats.Jitter, stats.DrawCalls, culling.LastCulled, culling.LastTested);
+    if (resolution.Enabled) {
+        size_t n = strlen(debug);
+        snprintf(debug + n, sizeof(debug) - n, " | %.0f%% res", stats.Scale*100);
+    }
+    hud.Debug = debug;
+    snprintf(title, sizeof(title), "Brick Breaker ~harshit mahajan | draws %d | culled %d of %d | GL state calls %d sent, %d filtered",
+             stats.DrawCalls, culling.LastCulled, culling.LastTested, stats.StateIssued, stats.StateFiltered);
+    if (redraw.Enabled) {
+        size_t n = strlen(title);
+        snprintf(title + n, sizeof(title) - n, " | %d drawn, %d skipped", redraw.LastDrawn, redraw.LastSkipped);
+    }
+    if (profiler.Enabled) {
+        size_t n = strlen(title);
+        snprintf(title + n, sizeof(title) - n, " | CPU %.2f ms, GPU %.2f ms", stats.CPU, stats.GPU);
+    }
+    if (window)
+        glfwSetWindowTitle(window, title);
+}
+
+void usage (const char* program)
+{
+    fprintf(stderr, "Usage: %s [--headless | --software] [--frames N] [--dump-every N] [--dump-prefix PATH]\n"
+                    "       [--capture FILE[.y4m]] [--capture-latency N] [--profile FILE.csv]\n"
+                    "       [--no-render-thread] [--always-redraw] [--program-cache DIR | --no-program-cache]\n"
+                    "       [--watch-shaders] [--dynamic-resolution FPS] [--pacing vsync|adaptive|uncapped|HZ]\n"
+                    "       [--late-latch] [--particle-benchmark N] [--no-background-cache]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+/* Command line options, see Readme */
+void parse_args (int argc, char** argv)
+{
+    for (int a=1; a<argc; a++) {
+        string arg = argv[a];
+        if (arg == "--headless")
+            headless.Enabled = 1;
+        else if (arg == "--software")
+            software.Enabled = headless.Enabled = 1;
+        else if (arg == "--frames" && a+1 < argc)
+            headless.Frames = atoi(argv[++a]);
+        else if (arg == "--dump-every" && a+1 < argc)
+            headless.DumpInterval = atoi(argv[++a]);
+        else if (arg == "--dump-prefix" && a+1 < argc)
+            headless.DumpPrefix = argv[++a];
+        else if (arg == "--capture" && a+1 < argc) {
+            capture.Enabled = 1;
+            capture.Path = argv[++a];
+        }
+        else if (arg == "--capture-latency" && a+1 < argc)
+            capture.Latency = max(1, atoi(argv[++a]));
+        else if (arg == "--no-render-thread")
+            render_thread.Enabled = 0;
+        else if (arg == "--always-redraw")
+            redraw.Enabled = 0;
+        else if (arg == "--program-cache" && a+1 < argc)
+            program_cache.Dir = argv[++a];
+        else if (arg == "--no-program-cache")
+            program_cache.Enabled = 0;
+        else if (arg == "--watch-shaders")
+            shader_reload.Enabled = 1;
+        else if (arg == "--particle-benchmark" && a+1 < argc)
+            particles.Benchmark = atoi(argv[++a]);
+        else if (arg == "--no-background-cache")
+            background.Enabled = 0;
+        else if (arg == "--late-latch")
+            input_latency.LateLatch = 1;
+        else if (arg == "--pacing" && a+1 < argc) {
+            string mode = argv[++a];
+            if (mode == "vsync")
+                pacing.Mode = PACING_VSYNC;
+            else if (mode == "adaptive")
+                pacing.Mode = PACING_ADAPTIVE;
+            else if (mode == "uncapped")
+                pacing.Mode = PACING_UNCAPPED;
+            else if (atof(mode.c_str()) > 0) {
+                pacing.Mode = PACING_LIMIT;
+                pacing.Rate = atof(mode.c_str());
+            }
+            else
+                usage(argv[0]);
+        }
+        else if (arg == "--dynamic-resolution" && a+1 < argc) {
+            resolution.Enabled = 1;
+            resolution.TargetMS = 1000.0f / max(1.0, atof(argv[++a]));
+        }
+        else if (arg == "--profile" && a+1 < argc) {
+            profiler.Enabled = 1;
+            profiler.Path = argv[++a];
+        }
+        else
+            usage(argv[0]);
+    }
 }
 
 int main (int argc, char** argv)
@@ -1371,38 +4964,81 @@ int main (int argc, char** argv)
 	int width = 1000;
 	int height = 700;
 
-    GLFWwindow* window = initGLFW(width, height);
+    parse_args(argc, argv);
+
+    GLFWwindow* window = NULL;
+    if (headless.Enabled) {
+        initHeadless(width, height);
+    }
+    else {
+        window = initGLFW(width, height);
+    }
 
 
 	initGL (window, width, height);
-  glfwGetCursorPos(window, &mouse_pos_x, &mouse_pos_y);
-    double last_update_time = glfwGetTime();
+    if (capture.Enabled) {
+        int fbwidth = width, fbheight = height;
+        if (window)
+            glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+        capture_init(fbwidth, fbheight);
+    }
+    if (shader_reload.Enabled)
+        shader_reload_init();
+  get_cursor_pos(window, &mouse_pos_x, &mouse_pos_y);
+    double last_update_time = game_time();
     old_time=last_update_time;
     laz_old_time=last_update_time-0.5;
     m_col_time=last_update_time;
+    render_thread_start(window);
+    redraw_init(window);
     /* Draw in loop */
-    while (!glfwWindowShouldClose(window)) {
+    int frames = 0;
+    while (headless.Enabled ? frames < headless.Frames : !glfwWindowShouldClose(window)) {
 
-        // OpenGL Draw commands
+        // Simulate and record the frame, the render thread draws it if anything changed
+        double frame_start = game_time();
+        if (shader_reload_poll())
+            redraw.Force = 1;   // frames carry the rebuild and swap
         draw(window);
+        int idle = !redraw_needed(window);
+        if (idle) {
+            render_discard();
+            redraw.Skipped++;
+        }
+        else {
+            render_submit(game_time() - frame_start);
+            redraw.Drawn++;
+        }
+        frames++;
 
-        // Swap Frame Buffer in double buffering
-        glfwSwapBuffers(window);
+        // Leave the final frame up for a moment, then end the game
+        if (hud.GameOver) {
+            while (window && !glfwWindowShouldClose(window) && game_time() - hud.GameOver < 3)
+                glfwWaitEventsTimeout(0.25);
+            break;
+        }
 
-        // Poll for Keyboard and mouse events
-        glfwPollEvents();
+        // Poll for Keyboard and mouse events, idle windows sleep until there are some
+        if (!headless.Enabled) {
+            if (idle)
+                glfwWaitEventsTimeout(redraw_wait());
+            else
+                glfwPollEvents();
+        }
 
         // Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
 
-        current_time = glfwGetTime(); // Time in seconds
+        current_time = game_time(); // Time in seconds
 
         if ((current_time - last_update_time) >= 0.5)
         {
-
+          redraw.LastDrawn = redraw.Drawn;
+          redraw.LastSkipped = redraw.Skipped;
+          redraw.Drawn = redraw.Skipped = 0;
+          show_stats(window, current_time - last_update_time);
           last_update_time = current_time;
         }
     }
 
-    glfwTerminate();
-    exit(EXIT_SUCCESS);
+    quit(window);
 }
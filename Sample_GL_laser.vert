@@ -0,0 +1,24 @@
+#version 330 core
+
+uniform mat4 VP;
+// 2 texels per laser from texel first on : (x, y, angle, length) (width, r, g, b)
+uniform samplerBuffer lasers;
+uniform int first;
+
+// output data : used by fragment shader
+out vec3 fragColor;
+
+void main ()
+{
+    int base = first + gl_InstanceID * 2;
+    vec4 place = texelFetch(lasers, base);
+    vec4 look = texelFetch(lasers, base + 1);
+
+    // Triangle strip corners (-1,-1) (1,-1) (-1,1) (1,1) around the centre, no vertex data needed
+    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+    vec2 local = corner * vec2(place.w, look.x) * 0.5;
+    float c = cos(place.z), s = sin(place.z);
+
+    fragColor = look.yzw;
+    gl_Position = VP * vec4(place.xy + vec2(c*local.x - s*local.y, s*local.x + c*local.y), 0, 1);
+}
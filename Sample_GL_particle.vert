@@ -0,0 +1,23 @@
+#version 330 core
+
+// per-instance data : one array each, see particles_execute()
+layout (location = 0) in float particleX;
+layout (location = 1) in float particleY;
+layout (location = 2) in float particleLife;    // seconds left
+layout (location = 3) in vec4 particleColor;
+
+uniform mat4 VP;
+uniform float size;
+
+// output data : used by fragment shader
+out vec3 fragColor;
+
+void main ()
+{
+    // Triangle strip corners (-1,-1) (1,-1) (-1,1) (1,1), no vertex data needed
+    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+    float radius = size * 0.5 * min(particleLife * 4.0, 1.0);
+
+    fragColor = particleColor.rgb;
+    gl_Position = VP * vec4(vec2(particleX, particleY) + corner * radius, 0, 1);
+}
@@ -0,0 +1,32 @@
+#version 330 core
+
+// input data : sent from main program
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec3 vertexColor;
+
+// draw ID : one per object, reaches us through baseInstance
+// (or is set directly for every draw on GL 3.3)
+layout (location = 4) in int drawID;
+
+uniform mat4 VP;
+// model matrix of every object, 4 texels (columns) each
+uniform samplerBuffer modelMatrices;
+
+// output data : used by fragment shader
+out vec3 fragColor;
+
+void main ()
+{
+    int base = drawID * 4;
+    mat4 model = mat4(texelFetch(modelMatrices, base),
+                      texelFetch(modelMatrices, base + 1),
+                      texelFetch(modelMatrices, base + 2),
+                      texelFetch(modelMatrices, base + 3));
+
+    // The color of each vertex will be interpolated
+    // to produce the color of each fragment
+    fragColor = vertexColor;
+
+    // Output position of the vertex, in clip space : VP * model * position
+    gl_Position = VP * model * vec4(vertexPosition, 1);
+}
@@ -0,0 +1,19 @@
+#version 330 core
+
+// Interpolated values from the vertex shaders
+in vec2 atlasCoord;
+in vec3 fragColor;
+
+// font atlas, one byte per texel
+uniform sampler2D atlas;
+
+// output data
+out vec3 color;
+
+void main()
+{
+    // Only the lit texels of the glyph are drawn
+    if (texture(atlas, atlasCoord).r < 0.5)
+        discard;
+    color = fragColor;
+}
@@ -0,0 +1,27 @@
+#version 330 core
+
+// input data : one instance per character
+layout (location = 0) in vec3 glyphPlace;   // bottom left corner, size of a font pixel
+layout (location = 1) in vec4 glyphColor;   // colour, and the glyph in alpha
+
+uniform mat4 VP;
+
+// output data : used by fragment shader
+out vec2 atlasCoord;
+out vec3 fragColor;
+
+// The atlas holds 16 x 6 cells of 6 x 8 texels, row 0 at the top
+const vec2 cell = vec2(6, 8);
+const vec2 atlasSize = vec2(16 * 6, 6 * 8);
+
+void main ()
+{
+    // Triangle strip corners (0,0) (1,0) (0,1) (1,1), no vertex data needed
+    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+    int glyph = int(glyphColor.a * 255.0 + 0.5);
+
+    atlasCoord = (vec2(glyph % 16, glyph / 16) + vec2(corner.x, 1.0 - corner.y)) * cell / atlasSize;
+    fragColor = glyphColor.rgb;
+
+    gl_Position = VP * vec4(glyphPlace.xy + corner * cell * glyphPlace.z, 0, 1);
+}
@@ -0,0 +1,12 @@
+#version 330 core
+
+uniform sampler2D frame;
+
+in vec2 frameCoord;
+
+out vec3 color;
+
+void main ()
+{
+    color = texture(frame, frameCoord).rgb;
+}
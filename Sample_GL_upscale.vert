@@ -0,0 +1,14 @@
+#version 330 core
+
+// of the frame texture, the part drawn to this frame
+uniform vec2 scale;
+
+out vec2 frameCoord;
+
+void main ()
+{
+    // Triangle strip corners (0,0) (1,0) (0,1) (1,1), no vertex data needed
+    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+    frameCoord = corner * scale;
+    gl_Position = vec4(corner * 2.0 - 1.0, 0, 1);
+}